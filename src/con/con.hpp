@@ -1,16 +1,18 @@
 #pragma once
 #include "types.hpp"
 #include "enum.hpp"
+#include "sixel.hpp"
 
 #include <cwchar>
 
 struct Con
 {
-    Pty       pty;
-    Term      term;
-    Selection sel;
-    CSIEscape csiescseq;
-    STREscape strescseq;
+    Pty          pty;
+    Term         term;
+    Selection    sel;
+    CSIEscape    csiescseq;
+    STREscape    strescseq;
+    SixelDecoder sixel;
 
     int twrite_aborted = 0;
     int su             = 0;
@@ -36,13 +38,14 @@ struct Con
 
     void csidump(void);
     void csihandle(void);
-    void readcolonargs(char**, int, std::array<std::array<int, ESC_ARG_SIZ>, CAR_PER_ARG>&);
-    void csiparse(void);
+    void csiparam(uchar);
+    void csicollect(uchar);
     void csireset(void);
-    int  eschandle(uchar);
+    void eschandle(uchar);
     void strdump(void);
     void strhandle(void);
     void strparse(void);
+    void strput(char const*, size_t);
     void strreset(void);
 
     int     tattrset(int);
@@ -65,21 +68,32 @@ struct Con
     void    tnewline(int);
     void    tputtab(int);
     void    tputc(Rune);
+    void    tputascii(char const*, int);
+    int     tpututf8(char const*, int);
     void    treset(void);
     void    tscrollup(int, int, int);
-    void    tscrolldown(int, int, int);
+    void    tscrolldown(int, int);
     void    tsetattr(int*, int);
     void    tsetchar(Rune, Glyph*, int, int);
     void    tsetdirt(int, int);
+    void    tsetdirtspan(int, int, int);
+    void    tsetscrolled(int, int, int);
     void    tsetscroll(int, int);
     void    tswapscreen(void);
     void    tsetmode(int, int, int*, int);
     int     twrite(std::string_view, int);
     void    tfulldirt(void);
+    void    timgadd(long long, Image&&);
+    void    timgdel(ImageMap::iterator&);
+    void    timgclear(int, int, int, int);
+    void    timgmove(int, int, int);
+    void    timgscrolled(int, int);
     void    tcontrolcode(uchar);
     void    tdectest(char);
     void    tdefutf8(char);
     int32_t tdefcolor(int*, int*, int);
+    ushort  tinternextra(GlyphExtra const&);
+    void    textragc(void);
     void    tdeftran(char);
     void    tstrsequence(uchar);
 };
@@ -89,10 +103,10 @@ struct Con
 #define ISCONTROLC1(c) (BETWEEN(c, 0x80, 0x9f))
 #define ISCONTROL(c) (ISCONTROLC0(c) || ISCONTROLC1(c))
 #define ISDELIM(u) (u && wcschr(worddelimiters, u))
-#define TLINE(y) ((y) < term.scr ? term.hist[((y) + term.histi - term.scr + HISTSIZE + 1) % HISTSIZE] : term.line[(y)-term.scr])
+#define TLINE(y) ((y) < term.scr ? term.hist[term.hist.len - term.scr + (y)] : term.line[(y)-term.scr])
 #define STRESCARGREST(n) ((n) == 0 ? strescseq.buf.data() : strescseq.argp[(n)-1] + 1)
 #define STRESCARGJUST(n) (*(strescseq.argp[n]) = '\0', STRESCARGREST(n))
-#define ATTRCMP(a, b) (((a).mode & (~ATTR_WRAP) & (~ATTR_LIGA)) != ((b).mode & (~ATTR_WRAP) & (~ATTR_LIGA)) || (a).fg != (b).fg || (a).bg != (b).bg)
+#define ATTRCMP(a, b) (((a).mode & (~ATTR_WRAP) & (~ATTR_LIGA)) != ((b).mode & (~ATTR_WRAP) & (~ATTR_LIGA)) || (a).fg != (b).fg || (a).bg != (b).bg || (a).extra != (b).extra)
 
 int    isboxdraw(Rune);
 ushort boxdrawindex(Glyph const*);
@@ -102,6 +116,12 @@ extern char const*    utmp;
 extern char const*    scroll;
 extern char const*    stty_args;
 extern char const*    vtiden;
+extern int            histsize;
+extern unsigned int   histmem;
+extern unsigned int   histspill;
+extern unsigned int   oscmax;
+extern unsigned int   dcsmax;
+extern unsigned int   imagemem;
 extern wchar_t const* worddelimiters;
 extern int            allowaltscreen;
 extern int            allowwindowops;
@@ -110,8 +130,4 @@ extern unsigned int   tabspaces;
 extern unsigned int   defaultfg;
 extern unsigned int   defaultbg;
 extern float          alpha;
-extern int const      boxdraw, boxdraw_bold, boxdraw_braille;
-
-#if defined(_WIN32)
-extern "C" int wcwidth(wchar_t);
-#endif
\ No newline at end of file
+extern int const      boxdraw, boxdraw_bold, boxdraw_braille;
\ No newline at end of file
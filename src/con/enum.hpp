@@ -67,14 +67,31 @@ enum cursor_state
 
 enum escape_state
 {
-    ESC_START      = 1,   //
-    ESC_CSI        = 2,   //
-    ESC_STR        = 4,   // OSC, PM, APC
-    ESC_ALTCHARSET = 8,   //
-    ESC_STR_END    = 16,  // a final string was encountered
-    ESC_TEST       = 32,  // Enter in test mode
-    ESC_UTF8       = 64,  //
-    ESC_DCS        = 128, //
+    ESC_GROUND,     // plain text
+    ESC_ESCAPE,     // after ESC
+    ESC_ESCAPE_INT, // ESC intermediates
+    ESC_CSI_ENTRY,  // after CSI
+    ESC_CSI_PARAM,  // CSI parameters
+    ESC_CSI_INT,    // CSI intermediates
+    ESC_CSI_IGNORE, // malformed CSI, skipped up to its final byte
+    ESC_STR,        // DCS, OSC, SOS, PM, APC
+    ESC_STR_ESC,    // ESC inside a string
+    ESC_STATES
+};
+
+enum escape_action
+{
+    ACT_NONE,         //
+    ACT_PRINT,        // show the character
+    ACT_EXECUTE,      // control code
+    ACT_CLEAR,        // start a new sequence
+    ACT_COLLECT,      // private marker or intermediate
+    ACT_PARAM,        // CSI parameter digit or separator
+    ACT_ESC_DISPATCH, //
+    ACT_CSI_DISPATCH, //
+    ACT_STR_START,    //
+    ACT_STR_PUT,      //
+    ACT_STR_END,      //
 };
 
 enum charset
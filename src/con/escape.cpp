@@ -3,45 +3,83 @@
 #include "../win.h"
 #include "../time.hpp"
 #include "../base64.hpp"
-#include <limits.h>
 
 extern TermWindow win;
 
-void Con::csiparse()
+/*
+ * A digit, ';' or ':' of a CSI sequence. Colon args belong to the arg
+ * before them, empty ones are skipped. Args past ESC_ARG_SIZ and colon
+ * args past CAR_PER_ARG are dropped.
+ */
+void Con::csiparam(uchar c)
 {
-    char *   p = csiescseq.buf.data(), *np;
-    long int v;
+    int* v;
 
-    csiescseq.narg = 0;
-    if (*p == '?')
+    switch (c)
     {
-        csiescseq.priv = 1;
-        p++;
-    }
+    case ';':
+        if (csiescseq.narg == ESC_ARG_SIZ)
+        {
+            csiescseq.ncarg = CAR_PER_ARG;
+            return;
+        }
+        csiescseq.carg[csiescseq.narg++].fill(-1);
+        csiescseq.ncarg = -1;
+        return;
 
-    csiescseq.buf[csiescseq.len] = '\0';
-    while (p < csiescseq.buf.data() + csiescseq.len)
-    {
-        np = NULL;
-        v  = strtol(p, &np, 10);
-        if (np == p)
-            v = 0;
-        if (v == LONG_MAX || v == LONG_MIN)
-            v = -1;
-        csiescseq.arg[csiescseq.narg++] = v;
-        p                               = np;
-        readcolonargs(&p, csiescseq.narg - 1, csiescseq.carg);
-        if (*p != ';' || csiescseq.narg == ESC_ARG_SIZ)
-            break;
-        p++;
+    case ':':
+        if (csiescseq.ncarg < 0 || (csiescseq.ncarg < CAR_PER_ARG && csiescseq.carg[csiescseq.narg - 1][csiescseq.ncarg] >= 0))
+            csiescseq.ncarg++;
+        return;
     }
-    csiescseq.mode[0] = *p++;
-    csiescseq.mode[1] = (p < csiescseq.buf.data() + csiescseq.len) ? *p : '\0';
+
+    if (csiescseq.ncarg < 0)
+        v = &csiescseq.arg[csiescseq.narg - 1];
+    else if (csiescseq.ncarg < CAR_PER_ARG)
+        v = &csiescseq.carg[csiescseq.narg - 1][csiescseq.ncarg];
+    else
+        return;
+    *v = MIN(MAX(*v, 0) * 10 + (c - '0'), ESC_ARG_MAX);
+}
+
+/* a private marker or an intermediate */
+void Con::csicollect(uchar c)
+{
+    if (c >= 0x3c)
+        csiescseq.priv = c;
+    else if (!csiescseq.inter[0])
+        csiescseq.inter[0] = c;
+    else
+        csiescseq.inter[1] = c;
 }
 
 void Con::csihandle()
 {
-    switch (csiescseq.mode[0])
+    /*
+     * DEC private sequences are marked with '?', '>' only goes with DA2,
+     * other private markers are not known
+     */
+    if (csiescseq.priv && csiescseq.priv != '?' && !(csiescseq.priv == '>' && csiescseq.mode == 'c'))
+        goto unknown;
+
+    switch (csiescseq.inter[0])
+    {
+    case '\0':
+        break;
+
+    case ' ':
+        if (csiescseq.mode == 'q' && !csiescseq.inter[1] && !csiescseq.priv) /* DECSCUSR -- Set Cursor Style */
+        {
+            if (!xsetcursor(csiescseq.arg[0]))
+                return;
+        }
+        goto unknown;
+
+    default:
+        goto unknown;
+    }
+
+    switch (csiescseq.mode)
     {
     default:
     unknown:
@@ -87,7 +125,7 @@ void Con::csihandle()
         }
         break;
 
-    case 'c': /* DA -- Device Attributes */
+    case 'c': /* DA, DA2 -- Device Attributes */
         if (csiescseq.arg[0] == 0)
             ttywrite(vtiden, 0);
         break;
@@ -158,14 +196,19 @@ void Con::csihandle()
             tclearregion(term.c.x, term.c.y, term.col - 1, term.c.y);
             if (term.c.y < term.row - 1)
                 tclearregion(0, term.c.y + 1, term.col - 1, term.row - 1);
+            timgclear(term.c.x, term.c.y, term.col - 1, term.row - 1);
+            timgclear(0, term.c.y + 1, term.col - 1, term.row - 1);
             break;
         case 1: /* above */
             if (term.c.y > 1)
                 tclearregion(0, 0, term.col - 1, term.c.y - 1);
             tclearregion(0, term.c.y, term.c.x, term.c.y);
+            timgclear(0, 0, term.c.x, term.c.y);
+            timgclear(0, 0, term.col - 1, term.c.y - 1);
             break;
         case 2: /* all */
             tclearregion(0, 0, term.col - 1, term.row - 1);
+            timgclear(0, 0, term.col - 1, term.row - 1);
             break;
         default:
             goto unknown;
@@ -177,12 +220,15 @@ void Con::csihandle()
         {
         case 0: /* right */
             tclearregion(term.c.x, term.c.y, term.col - 1, term.c.y);
+            timgclear(term.c.x, term.c.y, term.col - 1, term.c.y);
             break;
         case 1: /* left */
             tclearregion(0, term.c.y, term.c.x, term.c.y);
+            timgclear(0, term.c.y, term.c.x, term.c.y);
             break;
         case 2: /* all */
             tclearregion(0, term.c.y, term.col - 1, term.c.y);
+            timgclear(0, term.c.y, term.col - 1, term.c.y);
             break;
         }
         break;
@@ -194,7 +240,7 @@ void Con::csihandle()
 
     case 'T': /* SD -- Scroll <n> line down */
         DEFAULT(csiescseq.arg[0], 1);
-        tscrolldown(term.top, csiescseq.arg[0], 0);
+        tscrolldown(term.top, csiescseq.arg[0]);
         break;
 
     case 'L': /* IL -- Insert <n> blank lines */
@@ -214,6 +260,7 @@ void Con::csihandle()
     case 'X': /* ECH -- Erase <n> char */
         DEFAULT(csiescseq.arg[0], 1);
         tclearregion(term.c.x, term.c.y, term.c.x + csiescseq.arg[0] - 1, term.c.y);
+        timgclear(term.c.x, term.c.y, term.c.x + csiescseq.arg[0] - 1, term.c.y);
         break;
 
     case 'P': /* DCH -- Delete <n> char */
@@ -268,18 +315,6 @@ void Con::csihandle()
         tcursor(CURSOR_LOAD);
         break;
 
-    case ' ':
-        switch (csiescseq.mode[1])
-        {
-        case 'q': /* DECSCUSR -- Set Cursor Style */
-            if (xsetcursor(csiescseq.arg[0]))
-                goto unknown;
-            break;
-        default:
-            goto unknown;
-        }
-        break;
-
     case 't': /* title stack operations */
         switch (csiescseq.arg[0])
         {
@@ -331,32 +366,37 @@ void Con::csihandle()
     }
 }
 
+/* the sequence is not kept around, it is put back together from its parts */
 void Con::csidump()
 {
-    size_t i;
-    uint   c;
+    int i, j;
 
-    fprintf(stderr, "(%c) ESC[", csiescseq.mode[0]);
-    for (i = 0; i < csiescseq.len; i++)
+    fprintf(stderr, "(%c) ESC[", csiescseq.mode);
+    if (csiescseq.priv)
+        putc(csiescseq.priv, stderr);
+    for (i = 0; i < csiescseq.narg; i++)
+    {
+        fprintf(stderr, i ? ";%d" : "%d", csiescseq.arg[i]);
+        for (j = 0; j < CAR_PER_ARG && csiescseq.carg[i][j] >= 0; j++)
+            fprintf(stderr, ":%d", csiescseq.carg[i][j]);
+    }
+    for (char c : csiescseq.inter)
     {
-        c = csiescseq.buf[i] & 0xff;
-        if (isprint(c))
+        if (c)
             putc(c, stderr);
-        else if (c == '\n')
-            fprintf(stderr, "(\\n)");
-        else if (c == '\r')
-            fprintf(stderr, "(\\r)");
-        else if (c == 0x1b)
-            fprintf(stderr, "(\\e)");
-        else
-            fprintf(stderr, "(%02x)", c);
     }
-    putc('\n', stderr);
+    fprintf(stderr, "%c\n", csiescseq.mode);
 }
 
 void Con::csireset()
 {
-    memset(&csiescseq, 0, sizeof(csiescseq));
+    csiescseq.priv  = 0;
+    csiescseq.inter = {};
+    csiescseq.mode  = 0;
+    csiescseq.arg.fill(0);
+    csiescseq.narg  = 1;
+    csiescseq.ncarg = -1;
+    csiescseq.carg[0].fill(-1);
 }
 
 void Con::strhandle()
@@ -364,8 +404,12 @@ void Con::strhandle()
     char *p = NULL, *dec;
     int   j, narg, par;
 
-    term.esc &= ~(ESC_STR_END | ESC_STR);
-    strescseq.buf[strescseq.len] = '\0';
+    if (strescseq.dropped)
+    {
+        if (strescseq.max)
+            fprintf(stderr, "erresc: ESC%c string longer than %zu bytes dropped\n", strescseq.type, strescseq.max);
+        return;
+    }
 
     switch (strescseq.type)
     {
@@ -442,6 +486,7 @@ void Con::strhandle()
 
     case '_': /* APC -- Application Program Command */
     case '^': /* PM -- Privacy Message */
+    case 'X': /* SOS -- Start of String */
         return;
     }
 
@@ -476,7 +521,7 @@ void Con::strdump()
     uint   c;
 
     fprintf(stderr, "ESC%c", strescseq.type);
-    for (i = 0; i < strescseq.len; i++)
+    for (i = 0; i < strescseq.buf.size(); i++)
     {
         c = strescseq.buf[i] & 0xff;
         if (c == '\0')
@@ -508,55 +553,91 @@ void Con::strdump()
     fprintf(stderr, "ESC\\\n");
 }
 
+/*
+ * Append to the string. Past its limit the string is dropped and the
+ * rest of it ignored, so a runaway sequence cannot eat all the memory.
+ * Sixel images are not kept as a string, their data goes to the decoder
+ * as it comes in.
+ */
+void Con::strput(char const* s, size_t n)
+{
+    size_t i;
+
+    if (strescseq.dropped)
+        return;
+    if (IS_SET(MODE_SIXEL))
+    {
+        sixel.put(s, n);
+        return;
+    }
+    /* DCS Pn;Pn;Pn q, the parameters are not used */
+    if (strescseq.type == 'P' && strescseq.buf.find_first_not_of("0123456789;") == std::string::npos)
+    {
+        for (i = 0; i < n && (BETWEEN(s[i], '0', '9') || s[i] == ';'); i++)
+            ;
+        if (i < n && s[i] == 'q')
+        {
+            strescseq.buf.append(s, i + 1);
+            term.mode |= MODE_SIXEL;
+            sixel.start(strescseq.max);
+            sixel.put(s + i + 1, n - i - 1);
+            return;
+        }
+    }
+    if (strescseq.buf.size() + n > strescseq.max)
+    {
+        strescseq.dropped = 1;
+        std::string().swap(strescseq.buf);
+        return;
+    }
+    strescseq.buf.append(s, n);
+}
+
 void Con::strreset()
 {
+    /* only keep a small buffer around for the next string */
+    if (strescseq.buf.capacity() > STR_BUF_SIZ)
+        std::string().swap(strescseq.buf);
     strescseq.buf.clear();
-    strescseq.len = 0;
+    strescseq.dropped = 0;
 }
 
-/*
- * returns 1 when the sequence is finished and it hasn't to read
- * more characters for this sequence, otherwise 0
- */
-int Con::eschandle(uchar ascii)
+/* final byte of an ESC sequence, its intermediates are in csiescseq */
+void Con::eschandle(uchar ascii)
 {
-    switch (ascii)
+    switch (csiescseq.inter[1] ? -1 : csiescseq.inter[0])
     {
-    case '[':
-        term.esc |= ESC_CSI;
-        return 0;
+    case '\0':
+        break;
+
+    case '(': /* GZD4 -- set primary charset G0 */
+    case ')': /* G1D4 -- set secondary charset G1 */
+    case '*': /* G2D4 -- set tertiary charset G2 */
+    case '+': /* G3D4 -- set quaternary charset G3 */
+        term.icharset = csiescseq.inter[0] - '(';
+        tdeftran(ascii);
+        return;
 
     case '#':
-        term.esc |= ESC_TEST;
-        return 0;
+        tdectest(ascii);
+        return;
 
     case '%':
-        term.esc |= ESC_UTF8;
-        return 0;
+        tdefutf8(ascii);
+        return;
 
-    case 'P': /* DCS -- Device Control String */
-        term.esc |= ESC_DCS;
-        [[fallthrough]];
-    case '_': /* APC -- Application Program Command */
-    case '^': /* PM -- Privacy Message */
-    case ']': /* OSC -- Operating System Command */
-    case 'k': /* old title set compatibility */
-        tstrsequence(ascii);
-        return 0;
+    default:
+        fprintf(stderr, "erresc: unknown sequence ESC %c 0x%02X '%c'\n", csiescseq.inter[0], (uchar)ascii, isprint(ascii) ? ascii : '.');
+        return;
+    }
 
+    switch (ascii)
+    {
     case 'n': /* LS2 -- Locking shift 2 */
     case 'o': /* LS3 -- Locking shift 3 */
         term.charset = 2 + (ascii - 'n');
         break;
 
-    case '(': /* GZD4 -- set primary charset G0 */
-    case ')': /* G1D4 -- set secondary charset G1 */
-    case '*': /* G2D4 -- set tertiary charset G2 */
-    case '+': /* G3D4 -- set quaternary charset G3 */
-        term.icharset = ascii - '(';
-        term.esc |= ESC_ALTCHARSET;
-        return 0;
-
     case 'D': /* IND -- Linefeed */
         if (term.c.y == term.bot)
             tscrollup(term.top, 1, 1);
@@ -574,7 +655,7 @@ int Con::eschandle(uchar ascii)
 
     case 'M': /* RI -- Reverse index */
         if (term.c.y == term.top)
-            tscrolldown(term.top, 1, 1);
+            tscrolldown(term.top, 1);
         else
             tmoveto(term.c.x, term.c.y - 1);
         break;
@@ -606,36 +687,11 @@ int Con::eschandle(uchar ascii)
         tcursor(CURSOR_LOAD);
         break;
 
-    case '\\': /* ST -- String Terminator */
-        if (term.esc & ESC_STR_END)
-            strhandle();
+    case '\\': /* ST -- String Terminator, strings end in the parser */
         break;
 
     default:
         fprintf(stderr, "erresc: unknown sequence ESC 0x%02X '%c'\n", (uchar)ascii, isprint(ascii) ? ascii : '.');
         break;
     }
-    return 1;
 }
-
-void Con::readcolonargs(char** p, int cursor, std::array<std::array<int, ESC_ARG_SIZ>, CAR_PER_ARG>& params)
-{
-    int i = 0;
-    for (; i < CAR_PER_ARG; i++)
-        params[cursor][i] = -1;
-
-    if (**p != ':')
-        return;
-
-    char* np = NULL;
-    i        = 0;
-
-    while (**p == ':' && i < CAR_PER_ARG)
-    {
-        while (**p == ':')
-            (*p)++;
-        params[cursor][i] = strtol(*p, &np, 10);
-        *p                = np;
-        i++;
-    }
-}
\ No newline at end of file
@@ -0,0 +1,575 @@
+#include "types.hpp"
+
+#include <algorithm>
+
+#if !defined(_WIN32)
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/uio.h>
+#endif
+
+static void unpack(History::Inflated&, HistBlock::Index const*, HistSpan const*, char const*);
+static int  spillfile(void);
+
+size_t HistBlock::bytes(void) const
+{
+    return sizeof(*this) + lines.capacity() * sizeof(Index) + spans.capacity() * sizeof(HistSpan) + text.capacity();
+}
+
+/*
+ * Row y of the index, wrapped at col. Rows are copied out into a small
+ * LRU cache, so the pointer stays valid until HIST_CACHE other rows have
+ * been looked at or the history changes.
+ */
+Line History::operator[](int y)
+{
+    Row          r = row(y);
+    Rendered*    c = &rendered[0];
+    Glyph const* gp;
+    int          n;
+
+    for (auto& it : rendered)
+    {
+        if (it.gen == gen && it.row.seq == r.seq && it.row.start == r.start)
+        {
+            it.used = ++tick;
+            return it.cells.data();
+        }
+        if (it.used < c->used)
+            c = &it;
+    }
+
+    c->row  = r;
+    c->gen  = gen;
+    c->used = ++tick;
+    c->cells.resize(col);
+
+    gp = line(r.seq, &n);
+    linerow(c->cells.data(), col, gp, n, linecontent(gp, n), r.start, fill);
+
+    return c->cells.data();
+}
+
+/* index at least n rows, as far as there are lines; returns the rows indexed */
+int History::rows(int n)
+{
+    static std::vector<Row> v;
+    long long               seq;
+    int                     r;
+
+    while (len < n && frontier > base)
+    {
+        seq = --frontier;
+        if (seq == base + nlines - 1)
+        {
+            v.clear();
+            wrap(seq, 0, v);
+            last = v.back().start;
+            r    = v.size();
+        }
+        else
+        {
+            r = nrows(seq);
+        }
+
+        if (!index.empty() && index.front().seq / HIST_BLOCK == seq / HIST_BLOCK)
+        {
+            Chunk& c = index.front();
+
+            c.seq--;
+            c.lines++;
+            c.rows += r;
+            c.row -= r;
+        }
+        else
+        {
+            index.push_front({seq, 1, r, index.empty() ? 0 : index.front().row - r});
+        }
+        len += r;
+    }
+    return len;
+}
+
+/*
+ * Row y of the index. The chunk it is in is found by its first row, the
+ * rows of that chunk are wrapped again unless they were looked at lately.
+ */
+History::Row History::row(int y)
+{
+    static std::vector<Row> v;
+    Wrapped*                w   = &wrapped[0];
+    long long               abs = index.front().row + y;
+    int                     l;
+
+    auto c = std::upper_bound(index.begin(), index.end(), abs, [](long long r, Chunk const& c) { return r < c.row; }) - 1;
+
+    for (auto& it : wrapped)
+    {
+        if (it.col == col && it.chunk.seq == c->seq && it.chunk.lines == c->lines && it.chunk.rows == c->rows)
+        {
+            w = &it;
+            goto found;
+        }
+        if (it.used < w->used)
+            w = &it;
+    }
+
+    w->chunk = *c;
+    w->col   = col;
+    w->rows.clear();
+    for (l = 0; l < c->lines; l++)
+        wrap(c->seq + l, 0, w->rows);
+
+found:
+    w->used = ++tick;
+    return w->rows[abs - c->row];
+}
+
+/* the nb of rows line seq wraps to */
+int History::nrows(long long seq)
+{
+    Glyph const* gp;
+    int          n, content, start = 0, r = 0;
+
+    gp      = line(seq, &n);
+    content = linecontent(gp, n);
+    do
+    {
+        r++;
+        start = linebreak(gp, content, start, col);
+    } while (start < content);
+    return r;
+}
+
+/* the rows of line seq from cell start on */
+void History::wrap(long long seq, int start, std::vector<Row>& v)
+{
+    Glyph const* gp;
+    int          n, content;
+
+    gp      = line(seq, &n);
+    content = linecontent(gp, n);
+    do
+    {
+        v.push_back({seq, start});
+        start = linebreak(gp, content, start, col);
+    } while (start < content);
+}
+
+/*
+ * Add a row of col cells. It is joined to the newest line when that one
+ * was soft wrapped, otherwise it starts a new line.
+ */
+void History::push(Glyph const* src)
+{
+    static std::vector<Row> v;
+    size_t                  n   = ring.size();
+    long long               seq = base + nlines;
+
+    if (max == 0)
+        return;
+
+    v.clear();
+    gen++;
+    if (hot > 0 && (ring[(head + hot - 1) % n].back().mode & ATTR_WRAP))
+    {
+        auto& l = ring[(head + hot - 1) % n];
+
+        l.insert(l.end(), src, src + col);
+        mem += col * sizeof(Glyph);
+
+        /* only the last row of the line can change */
+        if (--seq >= frontier)
+        {
+            wrap(seq, last, v);
+            last = v.back().start;
+            index.back().rows += v.size() - 1;
+            len += v.size() - 1;
+        }
+    }
+    else
+    {
+        if ((size_t)hot == n)
+        {
+            /* grow the ring, unrolling it so the oldest line comes first */
+            std::rotate(ring.begin(), ring.begin() + head, ring.end());
+            ring.resize(MIN(MAX(2 * n, (size_t)64), (size_t)(HIST_HOT + HIST_BLOCK)));
+            head = 0;
+            n    = ring.size();
+        }
+
+        ring[(head + hot) % n].assign(src, src + col);
+        hot++;
+        nlines++;
+        mem += col * sizeof(Glyph);
+
+        wrap(seq, 0, v);
+        last = v.back().start;
+        if (!index.empty() && index.back().seq / HIST_BLOCK == seq / HIST_BLOCK)
+        {
+            index.back().lines++;
+            index.back().rows += v.size();
+        }
+        else
+        {
+            index.push_back({seq, 1, (int)v.size(), index.empty() ? 0 : index.back().row + index.back().rows});
+        }
+        len += v.size();
+
+        if (hot == HIST_HOT + HIST_BLOCK)
+            pack();
+    }
+
+    while (nlines > 0 && ((max > 0 && nlines > max) || (cap && mem > cap)))
+        drop();
+}
+
+/*
+ * Forget the oldest line. A block only gives its memory back once
+ * all of its lines are gone.
+ */
+void History::drop(void)
+{
+    int r;
+
+    if (!index.empty() && index.front().seq == base)
+    {
+        Chunk& c = index.front();
+
+        /* every line takes a row at least, as many rows as lines means one each */
+        r = c.rows == c.lines ? 1 : nrows(base);
+        c.seq++;
+        c.lines--;
+        c.rows -= r;
+        c.row += r;
+        len -= r;
+        if (c.lines == 0)
+            index.pop_front();
+    }
+    frontier = MAX(frontier, base + 1);
+
+    if (blocks.empty())
+    {
+        auto& l = ring[head];
+
+        mem -= l.size() * sizeof(Glyph);
+        /* long lines are not worth keeping around for reuse */
+        if (l.capacity() > (size_t)2 * col)
+            std::vector<Glyph>().swap(l);
+        head = (head + 1) % ring.size();
+        hot--;
+    }
+    else if (++blocks.front().first == HIST_BLOCK)
+    {
+        HistBlock& b = blocks.front();
+
+        for (auto& c : cache)
+        {
+            if (c.id == b.id)
+                c.id = -1;
+        }
+        if (b.off >= 0)
+        {
+#if defined(__linux)
+            fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, b.off, b.size);
+#endif
+            nspill--;
+        }
+        mem -= b.bytes();
+        blocks.pop_front();
+    }
+    base++;
+    nlines--;
+    gen++;
+}
+
+/*
+ * Lines are kept whole, so a new width only invalidates the index.
+ * It gets rebuilt by rows() as the history is scrolled back.
+ */
+void History::resize(int ncol, Glyph const& blank)
+{
+    fill = blank;
+    if (ncol == col)
+        return;
+
+    col      = ncol;
+    frontier = base + nlines;
+    len      = 0;
+    index.clear();
+    gen++;
+}
+
+/* move the oldest HIST_BLOCK hot lines into a new block */
+void History::pack(void)
+{
+    HistBlock b = {.id = nextid++, .first = 0};
+    char      buf[UTF_SIZ];
+    int       x, e, y, n;
+
+    b.lines.reserve(HIST_BLOCK + 1);
+    for (y = 0; y < HIST_BLOCK; y++)
+    {
+        auto& l = ring[(head + y) % ring.size()];
+
+        b.lines.push_back({(uint32_t)b.text.size(), (uint32_t)b.spans.size()});
+
+        n = linecontent(l.data(), l.size());
+        for (x = 0; x < n; x++)
+        {
+            if (l[x].u < 0x80)
+                b.text.push_back(l[x].u);
+            else
+                b.text.append(buf, utf8encode(l[x].u, buf));
+        }
+
+        for (x = 0, n = l.size(); x < n; x = e)
+        {
+            Glyph const& g = l[x];
+
+            for (e = x + 1; e < n && l[e].mode == g.mode && l[e].extra == g.extra && l[e].fg == g.fg && l[e].bg == g.bg; e++)
+                ;
+            b.spans.push_back({(uint32_t)(e - x), g.mode, g.extra, g.fg, g.bg});
+        }
+
+        mem -= l.size() * sizeof(Glyph);
+        if (l.capacity() > (size_t)2 * col)
+            std::vector<Glyph>().swap(l);
+    }
+    b.lines.push_back({(uint32_t)b.text.size(), (uint32_t)b.spans.size()});
+    b.spans.shrink_to_fit();
+    b.text.shrink_to_fit();
+
+    head = (head + HIST_BLOCK) % ring.size();
+    hot -= HIST_BLOCK;
+    mem += b.bytes();
+    blocks.push_back(std::move(b));
+
+    while (spill && mem > spill && nspill < blocks.size())
+        spillblock(blocks[nspill]);
+}
+
+/*
+ * Write b to the spill file and let go of its arrays. Blocks are page
+ * aligned so they can be mapped on their own. Spilling is turned off
+ * for good when the file cannot be written.
+ */
+void History::spillblock(HistBlock& b)
+{
+#if !defined(_WIN32)
+    long         page = sysconf(_SC_PAGESIZE);
+    struct iovec iov[3];
+
+    if (fd < 0 && (fd = spillfile()) < 0)
+    {
+        fprintf(stderr, "history: cannot create spill file: %s\n", strerror(errno));
+        spill = 0;
+        return;
+    }
+
+    iov[0] = {b.lines.data(), b.lines.size() * sizeof(HistBlock::Index)};
+    iov[1] = {b.spans.data(), b.spans.size() * sizeof(HistSpan)};
+    iov[2] = {b.text.data(), b.text.size()};
+    b.size = iov[0].iov_len + iov[1].iov_len + iov[2].iov_len;
+    b.off  = (end + page - 1) / page * page;
+    if (pwritev(fd, iov, LEN(iov), b.off) != (ssize_t)b.size)
+    {
+        fprintf(stderr, "history: cannot write spill file: %s\n", strerror(errno));
+        b.off = -1;
+        spill = 0;
+        return;
+    }
+    end = b.off + b.size;
+
+    mem -= b.bytes();
+    std::vector<HistBlock::Index>().swap(b.lines);
+    std::vector<HistSpan>().swap(b.spans);
+    std::string().swap(b.text);
+    mem += b.bytes();
+    nspill++;
+#else
+    spill = 0;
+#endif
+}
+
+/*
+ * Line seq and its length in *n. Cold lines are inflated a whole block
+ * at a time into a small LRU cache, so the pointer stays valid until
+ * HIST_CACHE other blocks have been looked at.
+ */
+Glyph const* History::line(long long seq, int* n)
+{
+    Inflated* c    = &cache[0];
+    int       y    = seq - base;
+    int       cold = nlines - hot;
+
+    if (y >= cold)
+    {
+        auto& l = ring[(head + y - cold) % ring.size()];
+
+        *n = l.size();
+        return l.data();
+    }
+
+    y += blocks.front().first;
+    HistBlock const& b = blocks[y / HIST_BLOCK];
+    y %= HIST_BLOCK;
+
+    for (auto& it : cache)
+    {
+        if (it.id == b.id)
+        {
+            c = &it;
+            goto found;
+        }
+        if (it.used < c->used)
+            c = &it;
+    }
+
+    c->id = b.id;
+    if (b.off < 0)
+    {
+        unpack(*c, b.lines.data(), b.spans.data(), b.text.data());
+    }
+    else
+    {
+#if !defined(_WIN32)
+        /* the page cache keeps recently read blocks around for us */
+        void* p = mmap(NULL, b.size, PROT_READ, MAP_SHARED, fd, b.off);
+
+        if (p != MAP_FAILED)
+        {
+            auto lines = (HistBlock::Index const*)p;
+            auto spans = (HistSpan const*)(lines + HIST_BLOCK + 1);
+            auto text  = (char const*)(spans + lines[HIST_BLOCK].span);
+
+            unpack(*c, lines, spans, text);
+            munmap(p, b.size);
+        }
+        else
+        {
+            fprintf(stderr, "history: cannot map spill file: %s\n", strerror(errno));
+            c->cells.clear();
+            c->start.assign(HIST_BLOCK + 1, 0);
+        }
+#endif
+    }
+
+found:
+    c->used = ++tick;
+    *n      = c->start[y + 1] - c->start[y];
+    return c->cells.data() + c->start[y];
+}
+
+/*
+ * Call f on the extra index of every cell kept, spilled lines included.
+ * The indices it changes are stored back, cached copies are dropped.
+ */
+void History::visitextras(std::function<void(ushort&)> const& f)
+{
+    std::vector<HistSpan> spans;
+    ushort                e;
+    int                   i, changed;
+
+    for (i = 0; i < hot; i++)
+    {
+        for (auto& g : ring[(head + i) % ring.size()])
+            f(g.extra);
+    }
+
+    for (auto& b : blocks)
+    {
+        if (b.off < 0)
+        {
+            for (auto& sp : b.spans)
+                f(sp.extra);
+            continue;
+        }
+
+#if !defined(_WIN32)
+        HistBlock::Index last;
+        off_t            off = b.off + HIST_BLOCK * sizeof(HistBlock::Index);
+
+        if (pread(fd, &last, sizeof(last), off) != sizeof(last))
+            continue;
+        off += sizeof(last);
+        spans.resize(last.span);
+        if (pread(fd, spans.data(), spans.size() * sizeof(HistSpan), off) != (ssize_t)(spans.size() * sizeof(HistSpan)))
+            continue;
+
+        for (changed = 0, i = 0; i < (int)spans.size(); i++)
+        {
+            e = spans[i].extra;
+            f(spans[i].extra);
+            changed |= e != spans[i].extra;
+        }
+        if (changed && pwrite(fd, spans.data(), spans.size() * sizeof(HistSpan), off) != (ssize_t)(spans.size() * sizeof(HistSpan)))
+            fprintf(stderr, "history: cannot write spill file: %s\n", strerror(errno));
+#endif
+    }
+
+    for (auto& c : cache)
+        c.id = -1;
+    gen++;
+}
+
+/* inflate HIST_BLOCK packed lines back to back */
+void unpack(History::Inflated& c, HistBlock::Index const* lines, HistSpan const* spans, char const* text)
+{
+    char const *s, *e;
+    Rune        u;
+    uint32_t    i, k;
+    size_t      x;
+    int         l;
+
+    for (x = 0, i = 0; i < lines[HIST_BLOCK].span; i++)
+        x += spans[i].len;
+    c.cells.resize(x);
+    c.start.resize(HIST_BLOCK + 1);
+
+    for (x = 0, l = 0; l < HIST_BLOCK; l++)
+    {
+        c.start[l] = x;
+        s          = text + lines[l].text;
+        e          = text + lines[l + 1].text;
+        for (i = lines[l].span; i < lines[l + 1].span; i++)
+        {
+            HistSpan const& sp = spans[i];
+            for (k = 0; k < sp.len; k++, x++)
+            {
+                u = ' ';
+                if (s < e)
+                    s += utf8decode(s, u, e - s);
+                c.cells[x] = {.u = u, .mode = sp.mode, .extra = sp.extra, .fg = sp.fg, .bg = sp.bg};
+            }
+        }
+    }
+    c.start[HIST_BLOCK] = x;
+}
+
+/* an unlinked temporary file, gone as soon as st exits */
+int spillfile(void)
+{
+#if !defined(_WIN32)
+    char        path[PATH_MAX];
+    char const* dir;
+    int         fd;
+
+    if ((dir = getenv("TMPDIR")) == NULL)
+        dir = "/tmp";
+    snprintf(path, sizeof(path), "%s/st-histXXXXXX", dir);
+    if ((fd = mkstemp(path)) < 0)
+        return -1;
+    unlink(path);
+    return fd;
+#else
+    return -1;
+#endif
+}
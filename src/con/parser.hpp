@@ -0,0 +1,103 @@
+#pragma once
+#include "enum.hpp"
+
+#include <array>
+
+// Escape sequence state machine after the DEC ANSI parser described at
+// https://vt100.net/emu/dec_ansi_parser. Every input byte in every state
+// maps to an action and the next state. Runes past 0xff are looked up as
+// 0xa0, they only matter as printable text or string contents.
+struct EscTransition
+{
+    unsigned char action; // escape_action
+    unsigned char next;   // escape_state
+};
+
+using EscTable = std::array<std::array<EscTransition, 256>, ESC_STATES>;
+
+constexpr EscTable escmaketable(void)
+{
+    EscTable t = {};
+
+    auto set = [&](int s, int lo, int hi, int action, int next) {
+        for (int c = lo; c <= hi; c++)
+            t[s][c] = {(unsigned char)action, (unsigned char)next};
+    };
+
+    // C0 controls are executed in place, except in strings
+    for (int s = 0; s < ESC_STATES; s++)
+    {
+        set(s, 0x00, 0x17, ACT_EXECUTE, s);
+        set(s, 0x19, 0x19, ACT_EXECUTE, s);
+        set(s, 0x1c, 0x1f, ACT_EXECUTE, s);
+        set(s, 0x20, 0xff, ACT_NONE, s);
+    }
+
+    set(ESC_GROUND, 0x20, 0x7e, ACT_PRINT, ESC_GROUND);
+    set(ESC_GROUND, 0x7f, 0x7f, ACT_EXECUTE, ESC_GROUND);
+    set(ESC_GROUND, 0xa0, 0xff, ACT_PRINT, ESC_GROUND);
+
+    set(ESC_ESCAPE, 0x20, 0x2f, ACT_COLLECT, ESC_ESCAPE_INT);
+    set(ESC_ESCAPE, 0x30, 0x7e, ACT_ESC_DISPATCH, ESC_GROUND);
+    set(ESC_ESCAPE, 0xa0, 0xff, ACT_ESC_DISPATCH, ESC_GROUND);
+    set(ESC_ESCAPE, '[', '[', ACT_NONE, ESC_CSI_ENTRY);
+    set(ESC_ESCAPE, ']', ']', ACT_STR_START, ESC_STR);  // OSC
+    set(ESC_ESCAPE, 'P', 'P', ACT_STR_START, ESC_STR);  // DCS
+    set(ESC_ESCAPE, 'X', 'X', ACT_STR_START, ESC_STR);  // SOS
+    set(ESC_ESCAPE, '^', '_', ACT_STR_START, ESC_STR);  // PM, APC
+    set(ESC_ESCAPE, 'k', 'k', ACT_STR_START, ESC_STR);  // old title set compatibility
+
+    set(ESC_ESCAPE_INT, 0x20, 0x2f, ACT_COLLECT, ESC_ESCAPE_INT);
+    set(ESC_ESCAPE_INT, 0x30, 0x7e, ACT_ESC_DISPATCH, ESC_GROUND);
+    set(ESC_ESCAPE_INT, 0xa0, 0xff, ACT_NONE, ESC_GROUND);
+
+    set(ESC_CSI_ENTRY, 0x20, 0x2f, ACT_COLLECT, ESC_CSI_INT);
+    set(ESC_CSI_ENTRY, 0x30, 0x3b, ACT_PARAM, ESC_CSI_PARAM);
+    set(ESC_CSI_ENTRY, 0x3c, 0x3f, ACT_COLLECT, ESC_CSI_PARAM); // private marker
+    set(ESC_CSI_ENTRY, 0x40, 0x7e, ACT_CSI_DISPATCH, ESC_GROUND);
+    set(ESC_CSI_ENTRY, 0xa0, 0xff, ACT_NONE, ESC_CSI_IGNORE);
+
+    set(ESC_CSI_PARAM, 0x20, 0x2f, ACT_COLLECT, ESC_CSI_INT);
+    set(ESC_CSI_PARAM, 0x30, 0x3b, ACT_PARAM, ESC_CSI_PARAM);
+    set(ESC_CSI_PARAM, 0x3c, 0x3f, ACT_NONE, ESC_CSI_IGNORE);
+    set(ESC_CSI_PARAM, 0x40, 0x7e, ACT_CSI_DISPATCH, ESC_GROUND);
+    set(ESC_CSI_PARAM, 0xa0, 0xff, ACT_NONE, ESC_CSI_IGNORE);
+
+    set(ESC_CSI_INT, 0x20, 0x2f, ACT_COLLECT, ESC_CSI_INT);
+    set(ESC_CSI_INT, 0x30, 0x3f, ACT_NONE, ESC_CSI_IGNORE);
+    set(ESC_CSI_INT, 0x40, 0x7e, ACT_CSI_DISPATCH, ESC_GROUND);
+    set(ESC_CSI_INT, 0xa0, 0xff, ACT_NONE, ESC_CSI_IGNORE);
+
+    set(ESC_CSI_IGNORE, 0x40, 0x7e, ACT_NONE, ESC_GROUND);
+
+    // strings take everything up to a terminator, controls included
+    set(ESC_STR, 0x00, 0xff, ACT_STR_PUT, ESC_STR);
+    set(ESC_STR, '\a', '\a', ACT_STR_END, ESC_GROUND); // xterm terminates with BEL
+
+    // ESC inside a string is ST when '\' follows, else a new sequence
+    t[ESC_STR_ESC] = t[ESC_ESCAPE];
+    set(ESC_STR_ESC, '\\', '\\', ACT_STR_END, ESC_GROUND);
+    set(ESC_STR_ESC, '\a', '\a', ACT_STR_END, ESC_GROUND);
+
+    // and from anywhere
+    for (int s = 0; s < ESC_STATES; s++)
+    {
+        set(s, 0x18, 0x18, ACT_EXECUTE, ESC_GROUND); // CAN
+        set(s, 0x1a, 0x1a, ACT_EXECUTE, ESC_GROUND); // SUB
+        set(s, 0x1b, 0x1b, ACT_CLEAR, ESC_ESCAPE);
+        set(s, 0x80, 0x9f, ACT_EXECUTE, ESC_GROUND);
+        set(s, 0x90, 0x90, ACT_STR_START, ESC_STR); // DCS
+        set(s, 0x98, 0x98, ACT_STR_START, ESC_STR); // SOS
+        set(s, 0x9b, 0x9b, ACT_CLEAR, ESC_CSI_ENTRY);
+        set(s, 0x9c, 0x9c, ACT_NONE, ESC_GROUND);   // ST
+        set(s, 0x9d, 0x9f, ACT_STR_START, ESC_STR); // OSC, PM, APC
+    }
+    // C1 controls are ignored within strings, but for ST
+    set(ESC_STR, 0x1b, 0x1b, ACT_CLEAR, ESC_STR_ESC);
+    set(ESC_STR, 0x80, 0x9f, ACT_NONE, ESC_STR);
+    set(ESC_STR, 0x9c, 0x9c, ACT_STR_END, ESC_GROUND);
+
+    return t;
+}
+
+inline constexpr EscTable esctable = escmaketable();
@@ -0,0 +1,191 @@
+#include "types.hpp"
+
+#include <algorithm>
+
+/*
+ * Resize to col x row cells, dropping the first `shift` rows. Kept cells
+ * are copied over, new cells are zeroed and left for the caller to clear.
+ */
+void TScreen::resize(int ncol, int nrow, int shift)
+{
+    std::vector<Glyph> ncells((size_t)ncol * nrow);
+    int                y, mincol = MIN(col, ncol);
+
+    for (y = 0; y < nrow && y + shift < row; y++)
+        memcpy(&ncells[(size_t)y * ncol], (*this)[y + shift], mincol * sizeof(Glyph));
+
+    cells = std::move(ncells);
+    slots.resize(nrow);
+    for (y = 0; y < nrow; y++)
+        slots[y] = y;
+
+    head = 0;
+    col  = ncol;
+    row  = nrow;
+}
+
+/*
+ * Rotate rows top..bot up by n (down when n is negative): the row at top + n
+ * ends up at top and the first n rows wrap around to the bottom. Rotating
+ * every row is a move of the ring head, anything else swaps slot indices.
+ */
+void TScreen::rotate(int top, int bot, int n)
+{
+    int len = bot - top + 1;
+
+    n %= len;
+    if (n < 0)
+        n += len;
+    if (n == 0)
+        return;
+
+    if (len == row)
+    {
+        head = (head + n) % row;
+        return;
+    }
+
+    auto slot    = [&](int y) -> int& { return slots[(head + y) % row]; };
+    auto reverse = [&](int a, int b) {
+        for (; a < b; a++, b--)
+            std::swap(slot(a), slot(b));
+    };
+
+    reverse(top, top + n - 1);
+    reverse(top + n, bot);
+    reverse(top, bot);
+}
+
+/*
+ * Rewrap to ncol x nrow. Rows ending in ATTR_WRAP are joined into logical
+ * lines and wrapped again at the new width, blank rows at the bottom are
+ * dropped and rows that no longer fit go to hist, oldest first. When x is
+ * given the cursor at (*x, *y) is moved along with its cell and kept on
+ * the screen.
+ */
+void TScreen::reflow(int ncol, int nrow, int* x, int* y, History& hist, Glyph const& blank)
+{
+    struct Piece
+    {
+        int line;    // offset of the logical line in buf
+        int len;     // its cells
+        int content; // cells up to the last non blank one
+        int start;   // first cell of the row
+    };
+
+    std::vector<Glyph> buf;
+    std::vector<Glyph> ncells((size_t)ncol * nrow, blank);
+    std::vector<Piece> rows;
+    int                last, i, l, o, start, shift, cx = 0, cy = 0;
+
+    for (last = row - 1; last > (x ? *y : -1) && linecontent((*this)[last], col) == 0; last--) {}
+
+    buf.resize((size_t)(last + 1) * col);
+    for (i = 0; i <= last; i++)
+        memcpy(&buf[(size_t)i * col], (*this)[i], col * sizeof(Glyph));
+
+    for (i = 0; i <= last; i = l)
+    {
+        for (l = i; l < last && (buf[(size_t)(l + 1) * col - 1].mode & ATTR_WRAP); l++) {}
+        l++;
+
+        Piece p = {i * col, (l - i) * col, 0, 0};
+        p.content = linecontent(&buf[p.line], p.len);
+
+        o = -1;
+        if (x && BETWEEN(*y, i, l - 1))
+        {
+            o         = (*y - i) * col + *x;
+            p.content = MAX(p.content, o + 1);
+        }
+
+        do
+        {
+            start = p.start;
+            rows.push_back(p);
+            p.start = linebreak(&buf[p.line], p.content, start, ncol);
+            if (BETWEEN(o, start, p.start - 1))
+            {
+                cx = o - start;
+                cy = rows.size() - 1;
+            }
+        } while (p.start < p.content);
+    }
+
+    shift = MAX((int)rows.size() - nrow, 0);
+    if (x)
+        shift = MIN(shift, cy);
+
+    for (i = 0; i < shift + nrow && i < (int)rows.size(); i++)
+    {
+        Piece const& p  = rows[i];
+        Glyph*       gp = &ncells[(size_t)MAX(i - shift, 0) * ncol];
+
+        linerow(gp, ncol, &buf[p.line], p.len, p.content, p.start, blank);
+        if (i < shift)
+        {
+            hist.push(gp);
+            std::fill(gp, gp + ncol, blank);
+        }
+    }
+
+    cells = std::move(ncells);
+    slots.resize(nrow);
+    for (i = 0; i < nrow; i++)
+        slots[i] = i;
+
+    head = 0;
+    col  = ncol;
+    row  = nrow;
+
+    if (x)
+    {
+        *x = cx;
+        *y = cy - shift;
+    }
+}
+
+int linecontent(Glyph const* gp, int n)
+{
+    while (n > 0 && gp[n - 1].u == ' ')
+        n--;
+    return n;
+}
+
+int linebreak(Glyph const* gp, int n, int start, int col)
+{
+    int end = start + col;
+
+    if (end >= n)
+        return n;
+    if (col > 1 && (gp[end - 1].mode & ATTR_WIDE))
+        end--;
+    return end;
+}
+
+/*
+ * Copy the row of line gp (len cells, content of them up to the last non
+ * blank one) starting at cell start to dst, padded with fill. Every row but
+ * the last gets ATTR_WRAP, the last one keeps it when the line continues.
+ */
+void linerow(Glyph* dst, int col, Glyph const* gp, int len, int content, int start, Glyph const& fill)
+{
+    int end  = linebreak(gp, content, start, col);
+    int last = end >= content;
+    int x;
+
+    for (x = 0; x < col; x++)
+    {
+        if (start + x < len && (last || start + x < end))
+        {
+            dst[x] = gp[start + x];
+            dst[x].mode &= ~ATTR_WRAP;
+        }
+        else
+        {
+            dst[x] = fill;
+        }
+    }
+    if (!last || (len > 0 && (gp[len - 1].mode & ATTR_WRAP)))
+        dst[col - 1].mode |= ATTR_WRAP;
+}
@@ -0,0 +1,409 @@
+#include "sixel.hpp"
+#include "../support.hpp"
+
+#include <algorithm>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define SIXEL_X86
+#endif
+
+/* numeric parameters past this are clamped, the image is dropped anyway */
+constexpr uint32_t SIXEL_PARAM_MAX = 1 << 24;
+
+#if defined(SIXEL_X86)
+/*
+ * One row of the band from a run of sixels: the sixels are widened to a
+ * lane each, the ones with the row's bit set take the color and the rest
+ * keep the pixel that is there.
+ */
+__attribute__((target("avx2"))) static size_t sixelrow_avx2(uint32_t* p, char const* s, size_t n, int bit, uint32_t c)
+{
+    __m256i off = _mm256_set1_epi32('?'), mask = _mm256_set1_epi32(bit), col = _mm256_set1_epi32(c);
+    size_t  k;
+
+    for (k = 0; k + 8 <= n; k += 8)
+    {
+        __m256i v   = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i const*)(s + k)));
+        __m256i set = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_sub_epi32(v, off), mask), mask);
+        __m256i old = _mm256_loadu_si256((__m256i const*)(p + k));
+
+        _mm256_storeu_si256((__m256i*)(p + k), _mm256_blendv_epi8(old, col, set));
+    }
+    return k;
+}
+
+__attribute__((target("sse2"))) static size_t sixelrow_sse2(uint32_t* p, char const* s, size_t n, int bit, uint32_t c)
+{
+    __m128i off = _mm_set1_epi32('?'), mask = _mm_set1_epi32(bit), col = _mm_set1_epi32(c), zero = _mm_setzero_si128();
+    size_t  k;
+    int     w;
+
+    for (k = 0; k + 4 <= n; k += 4)
+    {
+        memcpy(&w, s + k, sizeof(w));
+        __m128i v   = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(w), zero), zero);
+        __m128i set = _mm_cmpeq_epi32(_mm_and_si128(_mm_sub_epi32(v, off), mask), mask);
+        __m128i old = _mm_loadu_si128((__m128i const*)(p + k));
+
+        _mm_storeu_si128((__m128i*)(p + k), _mm_or_si128(_mm_and_si128(set, col), _mm_andnot_si128(set, old)));
+    }
+    return k;
+}
+
+__attribute__((target("avx2"))) static size_t sixelfill_avx2(uint32_t* p, size_t n, uint32_t c)
+{
+    __m256i col = _mm256_set1_epi32(c);
+    size_t  k;
+
+    for (k = 0; k + 8 <= n; k += 8)
+        _mm256_storeu_si256((__m256i*)(p + k), col);
+    return k;
+}
+
+__attribute__((target("sse2"))) static size_t sixelfill_sse2(uint32_t* p, size_t n, uint32_t c)
+{
+    __m128i col = _mm_set1_epi32(c);
+    size_t  k;
+
+    for (k = 0; k + 4 <= n; k += 4)
+        _mm_storeu_si128((__m128i*)(p + k), col);
+    return k;
+}
+#endif
+
+/* set the pixels of a run of sixels that have bit set to c */
+static void sixelrow(uint32_t* p, char const* s, size_t n, int bit, uint32_t c)
+{
+    size_t k = 0;
+
+#if defined(SIXEL_X86)
+    static int const avx2 = __builtin_cpu_supports("avx2");
+    static int const sse2 = __builtin_cpu_supports("sse2");
+
+    if (avx2)
+        k = sixelrow_avx2(p, s, n, bit, c);
+    else if (sse2)
+        k = sixelrow_sse2(p, s, n, bit, c);
+#endif
+    for (; k < n; k++)
+        if ((s[k] - '?') & bit)
+            p[k] = c;
+}
+
+/* set n pixels to c, for repeated sixels */
+static void sixelfill(uint32_t* p, size_t n, uint32_t c)
+{
+    size_t k = 0;
+
+#if defined(SIXEL_X86)
+    static int const avx2 = __builtin_cpu_supports("avx2");
+    static int const sse2 = __builtin_cpu_supports("sse2");
+
+    if (avx2)
+        k = sixelfill_avx2(p, n, c);
+    else if (sse2)
+        k = sixelfill_sse2(p, n, c);
+#endif
+    for (; k < n; k++)
+        p[k] = c;
+}
+
+/*
+ * HLS to RGB, hue in degrees, lightness and saturation in percent. It is
+ * worked out in units of 1 / 600000 so everything stays an integer.
+ */
+static uint32_t sixelhls(uint32_t h, uint32_t l, uint32_t s)
+{
+    /* where the chroma, the middle value and zero go for each sextant */
+    static int const order[6][3] = {{0, 1, 2}, {1, 0, 2}, {2, 0, 1}, {2, 1, 0}, {1, 2, 0}, {0, 2, 1}};
+    uint32_t         part[3], rgb[3], c, m;
+    int              sector, i;
+
+    h      = h % 360;
+    l      = MIN(l, 100u);
+    s      = MIN(s, 100u);
+    sector = h / 60;
+
+    c       = (100 - (l * 2 > 100 ? l * 2 - 100 : 100 - l * 2)) * s; /* 1 / 10000 */
+    m       = l * 6000 - c * 30;
+    part[0] = c * 60;
+    part[1] = c * (sector % 2 ? 60 - h % 60 : h % 60);
+    part[2] = 0;
+
+    for (i = 0; i < 3; i++)
+        rgb[i] = ((part[order[sector][i]] + m) * 255 + 300000) / 600000;
+    return rgb[0] << 16 | rgb[1] << 8 | rgb[2];
+}
+
+void SixelDecoder::start(size_t max)
+{
+    /* value initialised, so the color registers start out black */
+    *this     = SixelDecoder();
+    this->max = max;
+}
+
+/*
+ * Decode the next piece of the string. Everything is kept in the decoder
+ * between calls, a command may be split anywhere.
+ */
+void SixelDecoder::put(char const* s, size_t n)
+{
+    size_t k;
+    char   c;
+
+    for (; n > 0; s++, n--)
+    {
+        c = *s;
+        if (state != SIXEL_DATA)
+        {
+            if (BETWEEN(c, '0', '9'))
+            {
+                if (nparam < SIXEL_PARAMS)
+                    param[nparam] = MIN(param[nparam] * 10 + (c - '0'), SIXEL_PARAM_MAX);
+                continue;
+            }
+            if (c == ';')
+            {
+                if (nparam < SIXEL_PARAMS)
+                    nparam++;
+                continue;
+            }
+            command();
+        }
+
+        if (BETWEEN(c, '?', '~') && repeat > 1)
+        {
+            draw(c - '?', repeat);
+            repeat = 1;
+            continue;
+        }
+        if (BETWEEN(c, '?', '~'))
+        {
+            /* the sixels up to the next command are drawn as one run */
+            for (k = 1; k < n && BETWEEN(s[k], '?', '~'); k++)
+                ;
+            band(s, k);
+            s += k - 1;
+            n -= k - 1;
+            continue;
+        }
+
+        switch (c)
+        {
+        case '!': /* DECGRI -- graphics repeat introducer */
+            state = SIXEL_REPEAT;
+            break;
+        case '#': /* DECGCI -- color introducer */
+            state = SIXEL_COLOR;
+            break;
+        case '"': /* DECGRA -- raster attributes */
+            state = SIXEL_RASTER;
+            break;
+        case '-': /* DECGNL -- graphics next line */
+            line += 6;
+            col = 0;
+            break;
+        case '$': /* DECGCR -- graphics carriage return */
+            col = 0;
+            break;
+        default:
+            /* controls and anything unknown are ignored */
+            break;
+        }
+        if (state != SIXEL_DATA)
+        {
+            param.fill(0);
+            nparam = 0;
+        }
+    }
+}
+
+/* the parameters of a '!', '#' or '"' are complete */
+void SixelDecoder::command(void)
+{
+    uint32_t r, g, b;
+
+    switch (state)
+    {
+    case SIXEL_REPEAT:
+        repeat = MAX(param[0], 1u);
+        break;
+
+    case SIXEL_COLOR:
+        color = param[0] % colors.size();
+        if (nparam < 4)
+            break;
+
+        r = param[2], g = param[3], b = param[4];
+        switch (param[1])
+        {
+        case 1: /* HLS */
+            colors[color] = sixelhls(r, g, b);
+            break;
+        case 2: /* RGB, in percent */
+            r             = (MIN(r, 100u) * 255 + 50) / 100;
+            g             = (MIN(g, 100u) * 255 + 50) / 100;
+            b             = (MIN(b, 100u) * 255 + 50) / 100;
+            colors[color] = r << 16 | g << 8 | b;
+            break;
+        case 3: /* RGB, 0 to 255 */
+            colors[color] = (r & 0xff) << 16 | (g & 0xff) << 8 | (b & 0xff);
+            break;
+        default:
+            fprintf(stderr, "erresc: unknown sixel color space %u\n", param[1]);
+            break;
+        }
+        break;
+
+    case SIXEL_RASTER:
+        if (nparam < 3 || width > 0)
+            break;
+        /* the image takes its final size up front, no copies later */
+        pw = param[2];
+        ph = param[3];
+        grow(pw, DIVCEIL(ph, 6) * 6);
+        break;
+    }
+    state = SIXEL_DATA;
+}
+
+/*
+ * Make room for w x h pixels. The image doubles its width and height when
+ * it has to grow, but it never takes more than max bytes: past that it is
+ * dropped and the rest of its data ignored.
+ */
+int SixelDecoder::grow(size_t w, size_t h)
+{
+    std::vector<uint32_t> buf;
+    size_t                nstride, nrows, y;
+
+    if (dropped)
+        return 0;
+    if (w <= stride && h <= rows)
+        return 1;
+
+    nstride = w > stride ? MAX(w, stride * 2) : stride;
+    nrows   = h > rows ? MAX(h, rows * 2) : rows;
+    if (nstride * nrows > max / sizeof(uint32_t))
+    {
+        nstride = MAX(w, stride);
+        nrows   = MAX(h, rows);
+    }
+    if (nstride * nrows > max / sizeof(uint32_t))
+    {
+        fprintf(stderr, "erresc: sixel image larger than %zu bytes dropped\n", max);
+        std::vector<uint32_t>().swap(pixels);
+        dropped = 1;
+        return 0;
+    }
+
+    if (nstride == stride)
+    {
+        pixels.resize(nstride * nrows);
+    }
+    else
+    {
+        buf.resize(nstride * nrows);
+        for (y = 0; y < rows; y++)
+            std::copy_n(pixels.begin() + y * stride, stride, buf.begin() + y * nstride);
+        pixels.swap(buf);
+    }
+    stride = nstride;
+    rows   = nrows;
+    return 1;
+}
+
+/* draw a sixel count times at the cursor, a column of six pixels each */
+void SixelDecoder::draw(int bits, size_t count)
+{
+    uint32_t* p;
+    int       i;
+
+    if (bits && grow(col + count, line + 6))
+    {
+        p = pixels.data() + line * stride + col;
+        for (i = 0; i < 6; i++, p += stride)
+        {
+            if (bits & (1 << i))
+            {
+                sixelfill(p, count, colors[color]);
+                height = MAX(height, line + i + 1);
+            }
+        }
+        width = MAX(width, col + count);
+    }
+    col += count;
+}
+
+/*
+ * Draw a run of sixels at the cursor, one column each. The band is drawn
+ * a row at a time over the whole run rather than a column at a time.
+ */
+void SixelDecoder::band(char const* s, size_t n)
+{
+    uint32_t* p;
+    size_t    k, last = 0;
+    int       bits = 0, i;
+
+    for (k = 0; k < n; k++)
+    {
+        if (s[k] != '?')
+        {
+            bits |= s[k] - '?';
+            last = k + 1;
+        }
+    }
+    if (bits && grow(col + last, line + 6))
+    {
+        p = pixels.data() + line * stride + col;
+        for (i = 0; i < 6; i++, p += stride)
+        {
+            if (bits & (1 << i))
+            {
+                sixelrow(p, s, last, 1 << i, colors[color]);
+                height = MAX(height, line + i + 1);
+            }
+        }
+        width = MAX(width, col + last);
+    }
+    col += n;
+}
+
+/*
+ * The image and its size, the one from the raster attributes if there was
+ * one. Empty if it was dropped or nothing was drawn.
+ */
+std::tuple<std::vector<uint32_t>, size_t, size_t> SixelDecoder::finish(void)
+{
+    std::vector<uint32_t> buf;
+    size_t                w, h, y;
+
+    w = pw ? pw : width;
+    h = ph ? ph : height;
+    if (dropped || w == 0 || h == 0 || w * h > max / sizeof(uint32_t))
+    {
+        std::vector<uint32_t>().swap(pixels);
+        return {std::move(buf), 0, 0};
+    }
+
+    if (w == stride && h <= rows)
+    {
+        pixels.resize(w * h);
+        buf.swap(pixels);
+    }
+    else
+    {
+        buf.resize(w * h);
+        for (y = 0; y < MIN(h, rows); y++)
+            std::copy_n(pixels.begin() + y * stride, MIN(w, stride), buf.begin() + y * w);
+        std::vector<uint32_t>().swap(pixels);
+    }
+    return {std::move(buf), w, h};
+}
+
+/* the string was cancelled, nothing is shown */
+void SixelDecoder::cancel(void)
+{
+    std::vector<uint32_t>().swap(pixels);
+}
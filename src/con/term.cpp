@@ -1,5 +1,8 @@
 #include "con.hpp"
+#include "parser.hpp"
+#include "../unicode.hpp"
 #include "../win.h"
+#include <limits.h>
 
 extern TermWindow win;
 
@@ -20,11 +23,11 @@ int Con::tattrset(int attr)
 {
     int i, j;
 
-    for (i = 0; i < term.row - 1; i++)
+    for (i = 0; i < term.row; i++)
     {
-        for (j = 0; j < term.col - 1; j++)
+        for (j = 0; j < term.col; j++)
         {
-            if (term.line[i][j].mode & attr)
+            if (TLINE(i)[j].mode & attr)
                 return 1;
         }
     }
@@ -40,20 +43,61 @@ void Con::tsetdirt(int top, int bot)
     LIMIT(bot, 0, term.row - 1);
 
     for (i = top; i <= bot; i++)
-        term.dirty[i] = 1;
+        term.dirty[i] = {0, term.col - 1};
 }
 
+/* columns x1 to x2 of row y changed */
+void Con::tsetdirtspan(int y, int x1, int x2)
+{
+    DirtySpan& d = term.dirty[y];
+
+    d.x1 = MIN(d.x1, MAX(x1, 0));
+    d.x2 = MAX(d.x2, MIN(x2, term.col - 1));
+}
+
+/*
+ * Rows top to bot moved by n on screen. Runs of moves of the same rows
+ * are merged, past a few different ones the screen is drawn anew.
+ */
+void Con::tsetscrolled(int top, int bot, int n)
+{
+    TScroll* s = term.scrolls.empty() ? NULL : &term.scrolls.back();
+
+    if (n == 0)
+        return;
+    if (s && s->top == top && s->bot == bot && (s->n > 0) == (n > 0))
+    {
+        s->n += n;
+    }
+    else if (term.scrolls.size() < 16)
+    {
+        term.scrolls.push_back({top, bot, n});
+    }
+    else
+    {
+        term.scrolls.clear();
+        std::fill(term.drawn.begin(), term.drawn.end(), 0);
+    }
+}
+
+/*
+ * Rows with cells that look different without changing, blinking text,
+ * are drawn again whatever their hash says.
+ */
 void Con::tsetdirtattr(int attr)
 {
-    int i, j;
+    Line line;
+    int  i, j;
 
-    for (i = 0; i < term.row - 1; i++)
+    for (i = 0; i < term.row; i++)
     {
-        for (j = 0; j < term.col - 1; j++)
+        line = TLINE(i);
+        for (j = 0; j < term.col; j++)
         {
-            if (term.line[i][j].mode & attr)
+            if (line[j].mode & attr)
             {
                 tsetdirt(i, i);
+                term.drawn[i] = 0;
                 break;
             }
         }
@@ -67,8 +111,8 @@ void Con::tfulldirt(void)
 
 void Con::tcursor(int mode)
 {
-    static TCursor c[2];
-    int            alt = IS_SET(MODE_ALTSCREEN);
+    TCursor* c   = term.saved.data();
+    int      alt = IS_SET(MODE_ALTSCREEN);
 
     if (mode == CURSOR_SAVE)
     {
@@ -101,6 +145,7 @@ void Con::treset(void)
         tmoveto(0, 0);
         tcursor(CURSOR_SAVE);
         tclearregion(0, 0, term.col - 1, term.row - 1);
+        timgclear(0, 0, term.col - 1, term.row - 1);
         tswapscreen();
     }
 }
@@ -108,6 +153,11 @@ void Con::treset(void)
 void Con::tnew(int col, int row)
 {
     term = (Term){.c = {.attr = {.fg = defaultfg, .bg = defaultbg}}};
+    term.extras.push_back({.ustyle = -1, .ucolor = {-1, -1, -1}});
+    term.extraidx[term.extras[0]] = 0;
+    term.hist.max   = histsize;
+    term.hist.cap   = (size_t)histmem << 20;
+    term.hist.spill = (size_t)histspill << 20;
     tresize(col, row);
     treset();
 }
@@ -119,65 +169,60 @@ void Con::tswapscreen(void)
     tfulldirt();
 }
 
-void Con::tscrolldown(int orig, int n, int copyhist)
+/* history is left alone, rows scrolled off the bottom are gone */
+void Con::tscrolldown(int orig, int n)
 {
-    int  i;
-    Line temp;
-
     LIMIT(n, 0, term.bot - orig + 1);
 
-    if (copyhist)
-    {
-        term.histi            = (term.histi - 1 + HISTSIZE) % HISTSIZE;
-        temp                  = term.hist[term.histi];
-        term.hist[term.histi] = term.line[term.bot];
-        term.line[term.bot]   = temp;
-    }
-
     tsetdirt(orig, term.bot - n);
     tclearregion(0, term.bot - n + 1, term.col - 1, term.bot);
-
-    for (i = term.bot; i >= orig + n; i--)
-    {
-        temp             = term.line[i];
-        term.line[i]     = term.line[i - n];
-        term.line[i - n] = temp;
-    }
+    term.line.rotate(orig, term.bot, -n);
+    if (!term.images.empty())
+        timgmove(orig, term.bot, n);
 
     if (term.scr == 0)
+    {
+        tsetscrolled(orig, term.bot, -n);
         selscroll(orig, n);
+    }
 }
 
 void Con::tscrollup(int orig, int n, int copyhist)
 {
-    int  i;
-    Line temp;
+    int i;
 
     LIMIT(n, 0, term.bot - orig + 1);
 
     if (copyhist)
     {
-        term.histi            = (term.histi + 1) % HISTSIZE;
-        temp                  = term.hist[term.histi];
-        term.hist[term.histi] = term.line[orig];
-        term.line[orig]       = temp;
+        for (i = orig; i < orig + n; i++)
+            term.hist.push(term.line[i]);
     }
 
-    if (term.scr > 0 && term.scr < HISTSIZE)
-        term.scr = MIN(term.scr + n, HISTSIZE - 1);
-
-    tclearregion(0, orig, term.col - 1, orig + n - 1);
-    tsetdirt(orig + n, term.bot);
+    if (term.scr > 0)
+        term.scr = MIN(term.scr + n, term.hist.len);
 
-    for (i = orig; i <= term.bot - n; i++)
+    /* the whole main screen scrolling moves where rows are counted from */
+    if (orig == 0 && term.bot == term.row - 1 && !IS_SET(MODE_ALTSCREEN))
+    {
+        term.rowbase += n;
+        if (!term.images.empty())
+            timgscrolled(n, copyhist);
+    }
+    else if (!term.images.empty())
     {
-        temp             = term.line[i];
-        term.line[i]     = term.line[i + n];
-        term.line[i + n] = temp;
+        timgmove(orig, term.bot, -n);
     }
 
+    tclearregion(0, orig, term.col - 1, orig + n - 1);
+    tsetdirt(orig + n, term.bot);
+    term.line.rotate(orig, term.bot, n);
+
     if (term.scr == 0)
+    {
+        tsetscrolled(orig, term.bot, n);
         selscroll(orig, -n);
+    }
 }
 
 void Con::tnewline(int first_col)
@@ -254,7 +299,7 @@ void Con::tsetchar(Rune u, Glyph* attr, int x, int y)
         term.line[y][x - 1].mode &= ~ATTR_WIDE;
     }
 
-    term.dirty[y]     = 1;
+    tsetdirtspan(y, x - 1, x + 1);
     term.line[y][x]   = *attr;
     term.line[y][x].u = u;
 
@@ -266,6 +311,7 @@ void Con::tclearregion(int x1, int y1, int x2, int y2)
 {
     int    x, y, temp;
     Glyph* gp;
+    Glyph  blank = {.u = ' ', .mode = 0, .extra = 0, .fg = term.c.attr.fg, .bg = term.c.attr.bg};
 
     if (x1 > x2)
         temp = x1, x1 = x2, x2 = temp;
@@ -279,17 +325,14 @@ void Con::tclearregion(int x1, int y1, int x2, int y2)
 
     for (y = y1; y <= y2; y++)
     {
-        term.dirty[y] = 1;
-        for (x = x1; x <= x2; x++)
+        tsetdirtspan(y, x1, x2);
+        for (x = x1; sel.ob.x != -1 && x <= x2; x++)
         {
-            gp = &term.line[y][x];
             if (selected(x, y))
                 selclear();
-            gp->fg   = term.c.attr.fg;
-            gp->bg   = term.c.attr.bg;
-            gp->mode = 0;
-            gp->u    = ' ';
         }
+        gp = term.line[y];
+        std::fill(gp + x1, gp + x2 + 1, blank);
     }
 }
 
@@ -297,12 +340,13 @@ void Con::tdeletechar(int n)
 {
     LIMIT(n, 0, term.col - term.c.x);
 
-    auto  dst  = term.c.x;
-    auto  src  = term.c.x + n;
-    auto  size = term.col - src;
-    auto& line = term.line[term.c.y];
+    auto dst  = term.c.x;
+    auto src  = term.c.x + n;
+    auto size = term.col - src;
+    auto line = term.line[term.c.y];
 
     memmove(&line[dst], &line[src], size * sizeof(Glyph));
+    tsetdirtspan(term.c.y, dst, term.col - 1);
     tclearregion(term.col - n, term.c.y, term.col - 1, term.c.y);
 }
 
@@ -310,19 +354,20 @@ void Con::tinsertblank(int n)
 {
     LIMIT(n, 0, term.col - term.c.x);
 
-    auto  dst  = term.c.x + n;
-    auto  src  = term.c.x;
-    auto  size = term.col - dst;
-    auto& line = term.line[term.c.y];
+    auto dst  = term.c.x + n;
+    auto src  = term.c.x;
+    auto size = term.col - dst;
+    auto line = term.line[term.c.y];
 
     memmove(&line[dst], &line[src], size * sizeof(Glyph));
+    tsetdirtspan(term.c.y, src, term.col - 1);
     tclearregion(src, term.c.y, dst - 1, term.c.y);
 }
 
 void Con::tinsertblankline(int n)
 {
     if (BETWEEN(term.c.y, term.top, term.bot))
-        tscrolldown(term.c.y, n, 0);
+        tscrolldown(term.c.y, n);
 }
 
 void Con::tdeleteline(int n)
@@ -377,10 +422,74 @@ int32_t Con::tdefcolor(int* attr, int* npar, int l)
     return idx;
 }
 
+ushort Con::tinternextra(GlyphExtra const& extra)
+{
+    size_t i;
+
+    auto it = term.extraidx.find(extra);
+    if (it != term.extraidx.end())
+        return it->second;
+
+    /* out of indices, make room by forgetting the ones no cell uses */
+    if (term.extras.size() > USHRT_MAX)
+        textragc();
+    /* all of them still in use, drop the attributes rather than alias another entry */
+    if ((i = term.extras.size()) > USHRT_MAX)
+        return 0;
+
+    term.extras.push_back(extra);
+    term.extraidx[extra] = i;
+    return i;
+}
+
+/*
+ * Forget the extras no cell refers to anymore and number the others
+ * anew, in the screens, the cursors and the history alike. Rows are
+ * drawn again, the same index may now stand for something else.
+ */
+void Con::textragc(void)
+{
+    std::vector<ushort>     to(term.extras.size(), 0);
+    std::vector<GlyphExtra> kept;
+    size_t                  i;
+
+    auto visit = [&](std::function<void(ushort&)> const& f) {
+        f(term.c.attr.extra);
+        for (auto& c : term.saved)
+            f(c.attr.extra);
+        for (auto& g : term.line.cells)
+            f(g.extra);
+        for (auto& g : term.alt.cells)
+            f(g.extra);
+        f(term.hist.fill.extra);
+        term.hist.visitextras(f);
+    };
+
+    to[0] = 1;
+    visit([&](ushort& e) { to[e] = 1; });
+
+    for (i = 0; i < to.size(); i++)
+    {
+        if (to[i])
+        {
+            to[i] = kept.size();
+            kept.push_back(term.extras[i]);
+        }
+    }
+    visit([&](ushort& e) { e = to[e]; });
+
+    term.extras.swap(kept);
+    term.extraidx.clear();
+    for (i = 0; i < term.extras.size(); i++)
+        term.extraidx[term.extras[i]] = i;
+    std::fill(term.drawn.begin(), term.drawn.end(), 0);
+}
+
 void Con::tsetattr(int* attr, int l)
 {
-    int     i;
-    int32_t idx;
+    int        i;
+    int32_t    idx;
+    GlyphExtra extra = term.extras[term.c.attr.extra];
 
     for (i = 0; i < l; i++)
     {
@@ -388,12 +497,9 @@ void Con::tsetattr(int* attr, int l)
         {
         case 0:
             term.c.attr.mode &= ~(ATTR_BOLD | ATTR_FAINT | ATTR_ITALIC | ATTR_UNDERLINE | ATTR_BLINK | ATTR_REVERSE | ATTR_INVISIBLE | ATTR_STRUCK);
-            term.c.attr.fg        = defaultfg;
-            term.c.attr.bg        = defaultbg;
-            term.c.attr.ustyle    = -1;
-            term.c.attr.ucolor[0] = -1;
-            term.c.attr.ucolor[1] = -1;
-            term.c.attr.ucolor[2] = -1;
+            term.c.attr.fg = defaultfg;
+            term.c.attr.bg = defaultbg;
+            extra          = term.extras[0];
             break;
         case 1:
             term.c.attr.mode |= ATTR_BOLD;
@@ -405,9 +511,9 @@ void Con::tsetattr(int* attr, int l)
             term.c.attr.mode |= ATTR_ITALIC;
             break;
         case 4:
-            term.c.attr.ustyle = csiescseq.carg[i][0];
+            extra.ustyle = csiescseq.carg[i][0];
 
-            if (term.c.attr.ustyle != 0)
+            if (extra.ustyle != 0)
                 term.c.attr.mode |= ATTR_UNDERLINE;
             else
                 term.c.attr.mode &= ~ATTR_UNDERLINE;
@@ -464,15 +570,15 @@ void Con::tsetattr(int* attr, int l)
             term.c.attr.bg = defaultbg;
             break;
         case 58:
-            term.c.attr.ucolor[0] = csiescseq.carg[i][1];
-            term.c.attr.ucolor[1] = csiescseq.carg[i][2];
-            term.c.attr.ucolor[2] = csiescseq.carg[i][3];
+            extra.ucolor[0] = csiescseq.carg[i][1];
+            extra.ucolor[1] = csiescseq.carg[i][2];
+            extra.ucolor[2] = csiescseq.carg[i][3];
             term.c.attr.mode ^= ATTR_DIRTYUNDERLINE;
             break;
         case 59:
-            term.c.attr.ucolor[0] = -1;
-            term.c.attr.ucolor[1] = -1;
-            term.c.attr.ucolor[2] = -1;
+            extra.ucolor[0] = -1;
+            extra.ucolor[1] = -1;
+            extra.ucolor[2] = -1;
             term.c.attr.mode ^= ATTR_DIRTYUNDERLINE;
             break;
         default:
@@ -500,6 +606,9 @@ void Con::tsetattr(int* attr, int l)
             break;
         }
     }
+
+    if (extra != term.extras[term.c.attr.extra])
+        term.c.attr.extra = tinternextra(extra);
 }
 
 void Con::tsetscroll(int t, int b)
@@ -597,6 +706,14 @@ void Con::tsetmode(int priv, int set, int* args, int narg)
                 {
                     tclearregion(0, 0, term.col - 1, term.row - 1);
                 }
+                /* nothing keeps the images of the alternate screen once it is left */
+                for (auto it = term.images.begin(); alt && !set && it != term.images.end();)
+                {
+                    if (it->second.alt)
+                        timgdel(it);
+                    else
+                        ++it;
+                }
                 if (set ^ alt) /* set is always 1 or 0 */
                     tswapscreen();
                 if (*args != 1049)
@@ -772,10 +889,36 @@ void Con::tstrsequence(uchar c)
     case 0x9d: /* OSC -- Operating System Command */
         c = ']';
         break;
+
+    case 0x98: /* SOS -- Start of String */
+        c = 'X';
+        break;
     }
 
     strescseq.type = c;
-    term.esc |= ESC_STR;
+    switch (c)
+    {
+    case 'P':
+        strescseq.max = dcsmax;
+        break;
+    case ']':
+    case 'k':
+        strescseq.max = oscmax;
+        break;
+    default: /* not looked at, not kept */
+        strescseq.max = 0;
+        break;
+    }
+}
+
+/* length of the run at s that goes into a string as it is */
+static size_t strrun(char const* s, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n && !(s[i] & 0x80) && esctable[ESC_STR][(uchar)s[i]].action == ACT_STR_PUT; i++)
+        ;
+    return i;
 }
 
 void Con::tcontrolcode(uchar ascii)
@@ -802,17 +945,7 @@ void Con::tcontrolcode(uchar ascii)
         return;
 
     case '\a': /* BEL */
-        if (term.esc & ESC_STR_END)
-            /* backwards compatibility to xterm */
-            strhandle();
-        else
-            xbell();
-        break;
-
-    case '\033': /* ESC */
-        csireset();
-        term.esc &= ~(ESC_CSI | ESC_ALTCHARSET | ESC_TEST);
-        term.esc |= ESC_START;
+        xbell();
         return;
 
     case '\016': /* SO (LS1 -- Locking shift 1) */
@@ -822,10 +955,10 @@ void Con::tcontrolcode(uchar ascii)
 
     case '\032': /* SUB */
         tsetchar('?', &term.c.attr, term.c.x, term.c.y);
-        [[fallthrough]];
+        return;
+
     case '\030': /* CAN */
-        csireset();
-        break;
+        return;
 
     case '\005': /* ENQ (IGNORED) */
     case '\000': /* NUL (IGNORED) */
@@ -867,27 +1000,13 @@ void Con::tcontrolcode(uchar ascii)
     case 0x95: /* TODO: MW */
     case 0x96: /* TODO: SPA */
     case 0x97: /* TODO: EPA */
-    case 0x98: /* TODO: SOS */
     case 0x99: /* TODO: SGCI */
         break;
 
     case 0x9a: /* DECID -- Identify Terminal */
         ttywrite(vtiden, 0);
         break;
-
-    case 0x9b: /* TODO: CSI */
-    case 0x9c: /* TODO: ST */
-        break;
-
-    case 0x90: /* DCS -- Device Control String */
-    case 0x9d: /* OSC -- Operating System Command */
-    case 0x9e: /* PM -- Privacy Message */
-    case 0x9f: /* APC -- Application Program Command */
-        tstrsequence(ascii);
-        return;
     }
-    /* only CAN, SUB, \a and C1 chars interrupt a sequence */
-    term.esc &= ~(ESC_STR_END | ESC_STR);
 }
 
 int Con::twrite(std::string_view buf, int show_ctrl)
@@ -901,7 +1020,30 @@ int Con::twrite(std::string_view buf, int show_ctrl)
 
     for (n = 0; n < buf.size(); n += charsize)
     {
-        if (IS_SET(MODE_UTF8) && !IS_SET(MODE_SIXEL))
+        if (su0 && !su)
+        {
+            twrite_aborted = 1;
+            break; // ESU - allow rendering before a new BSU
+        }
+        if (!show_ctrl && !term.esc && !IS_SET(MODE_PRINT | MODE_INSERT | MODE_SIXEL) && term.trantbl[term.charset] != CS_GRAPHIC0)
+        {
+            /* runs of printable ASCII go straight to the line */
+            if ((charsize = utf8asciirun(buf.data() + n, buf.size() - n)) > 0)
+            {
+                tputascii(buf.data() + n, charsize);
+                continue;
+            }
+            /* as do other printable characters */
+            if (IS_SET(MODE_UTF8) && (charsize = tpututf8(buf.data() + n, buf.size() - n)) > 0)
+                continue;
+        }
+        /* and string contents to the string */
+        if (!show_ctrl && term.esc == ESC_STR && !IS_SET(MODE_PRINT) && (charsize = strrun(buf.data() + n, buf.size() - n)) > 0)
+        {
+            strput(buf.data() + n, charsize);
+            continue;
+        }
+        if (IS_SET(MODE_UTF8) && !IS_SET(MODE_SIXEL) && (buf[n] & 0x80))
         {
             /* process a complete utf8 char */
             charsize = utf8decode(buf.data() + n, u, buf.size() - n);
@@ -913,11 +1055,6 @@ int Con::twrite(std::string_view buf, int show_ctrl)
             u        = buf[n] & 0xFF;
             charsize = 1;
         }
-        if (su0 && !su)
-        {
-            twrite_aborted = 1;
-            break; // ESU - allow rendering before a new BSU
-        }
         if (show_ctrl && ISCONTROL(u))
         {
             if (u & 0x80)
@@ -939,10 +1076,14 @@ int Con::twrite(std::string_view buf, int show_ctrl)
 
 void Con::tresize(int col, int row)
 {
-    int     i, j;
+    int     i;
     int     minrow = MIN(row, term.row);
     int     mincol = MIN(col, term.col);
+    int     shift  = MAX(term.c.y - row + 1, 0);
+    int     reflow = term.col > 0 && col != term.col;
+    int     alt    = IS_SET(MODE_ALTSCREEN);
     int*    bp;
+    Glyph   blank;
     TCursor c;
 
     if (col < 1 || row < 1)
@@ -951,52 +1092,42 @@ void Con::tresize(int col, int row)
         return;
     }
 
+    /* history rewraps lazily, only what is about to be shown */
+    blank   = term.c.attr;
+    blank.u = ' ';
+    term.hist.resize(col, blank);
+
     /*
-     * slide screen to keep cursor where we expect it -
-     * tscrollup would work here, but we can optimize to
-     * memmove because we're freeing the earlier lines
+     * a new width rewraps the main screen, pushing what no longer fits
+     * into history; otherwise both screens slide up to keep the cursor
+     * where we expect it, new cells are cleared further down
      */
-    for (i = 0; i <= term.c.y - row; i++)
+    if (reflow)
     {
-        term.line[i].~vector();
-        term.alt[i].~vector();
-    }
-    /* ensure that both src and dst are not NULL */
-    if (i > 0)
-    {
-        memmove(term.line.data(), term.line.data() + i, row * sizeof(Line));
-        memmove(term.alt.data(), term.alt.data() + i, row * sizeof(Line));
-    }
-
-    /* resize to new height */
-    term.line.resize(row);
-    term.alt.resize(row);
-    term.dirty.resize(row);
-    term.tabs.resize(col);
-
-    for (i = 0; i < HISTSIZE; i++)
-    {
-        term.hist[i].resize(col);
-        for (j = mincol; j < col; j++)
+        selclear();
+        if (alt)
         {
-            term.hist[i][j]   = term.c.attr;
-            term.hist[i][j].u = ' ';
+            /* the cursor the main screen gets back on leaving moves with its cell */
+            term.alt.reflow(col, row, &term.saved[0].x, &term.saved[0].y, term.hist, blank);
+            term.line.resize(col, row, shift);
+        }
+        else
+        {
+            term.line.reflow(col, row, &term.c.x, &term.c.y, term.hist, blank);
+            term.alt.resize(col, row, shift);
         }
     }
-
-    /* resize each row to new width, zero-pad if needed */
-    for (i = 0; i < minrow; i++)
-    {
-        term.line[i].resize(col);
-        term.alt[i].resize(col);
-    }
-
-    /* allocate any new rows */
-    for (/* i = minrow */; i < row; i++)
+    else
     {
-        term.line[i].resize(col);
-        term.alt[i].resize(col);
+        term.line.resize(col, row, shift);
+        term.alt.resize(col, row, shift);
     }
+    term.dirty.resize(row);
+    term.drawn.assign(row, 0);
+    term.scrolls.clear();
+    term.tabs.resize(col);
+    /* a view further back than HIST_REFLOW moves closer, resizes stay cheap */
+    term.scr = MIN(term.scr, term.hist.rows(MIN(term.scr, HIST_REFLOW)));
     if (col > term.col)
     {
         bp = term.tabs.data() + term.col;
@@ -1017,171 +1148,448 @@ void Con::tresize(int col, int row)
     c = term.c;
     for (i = 0; i < 2; i++)
     {
-        if (mincol < col && 0 < minrow)
-        {
-            tclearregion(mincol, 0, col - 1, minrow - 1);
-        }
-        if (0 < col && minrow < row)
+        /* the reflowed main screen is already filled in */
+        if (!reflow || IS_SET(MODE_ALTSCREEN))
         {
-            tclearregion(0, minrow, col - 1, row - 1);
+            if (mincol < col && 0 < minrow)
+            {
+                tclearregion(mincol, 0, col - 1, minrow - 1);
+            }
+            if (0 < col && minrow < row)
+            {
+                tclearregion(0, minrow, col - 1, row - 1);
+            }
         }
         tswapscreen();
         tcursor(CURSOR_LOAD);
     }
     term.c = c;
+    /* the window is redrawn from scratch */
+    tfulldirt();
 }
 
-#include "sixel.hpp"
-
-void Con::tputc(Rune u)
+/*
+ * What tputc does for a run of printable ASCII, a line at a time: there is
+ * no sequence state, charset translation, box drawing or wide glyph to deal
+ * with, only wide glyphs cut in half at the ends of the run.
+ */
+void Con::tputascii(char const* s, int len)
 {
-    static std::string sixel;
-
-    char   c[UTF_SIZ];
-    int    control;
-    int    width, len;
     Glyph* gp;
+    int    i, n, x, y;
 
-    control = ISCONTROL(u);
-    if (u < 127 || !IS_SET(MODE_UTF8 | MODE_SIXEL))
+    while (len > 0)
     {
-        c[0]  = u;
-        width = len = 1;
-    }
-    else
-    {
-        len = utf8encode(u, c);
-        if (!control && (width = wcwidth(u)) == -1)
-            width = 1;
-    }
+        if (IS_SET(MODE_WRAP) && (term.c.state & CURSOR_WRAPNEXT))
+        {
+            term.line[term.c.y][term.c.x].mode |= ATTR_WRAP;
+            tnewline(1);
+        }
 
-    if (IS_SET(MODE_PRINT))
-        tprinter(c, len);
+        x  = term.c.x;
+        y  = term.c.y;
+        n  = MIN(len, term.col - x);
+        gp = term.line[y];
 
-    /*
-     * STR sequence must be checked before anything else
-     * because it uses all following characters until it
-     * receives a ESC, a SUB, a ST or any other C1 control
-     * character.
-     */
-    if (term.esc & ESC_STR)
-    {
-        if (u == '\a' || u == 030 || u == 032 || u == 033 || ISCONTROLC1(u))
+        if (sel.ob.x != -1 && BETWEEN(y, sel.nb.y, sel.ne.y))
         {
-            if (IS_SET(MODE_SIXEL))
+            for (i = x; i < x + n; i++)
             {
-                term.mode &= ~MODE_SIXEL;
-                Image new_image{
-                    .x = static_cast<size_t>(term.c.x),
-                    .y = static_cast<size_t>(term.c.y),
-                };
-                std::tie(new_image.data, new_image.width, new_image.height) = parse_sixel(sixel);
-
-                sixel.clear();
-                term.images.push_back(new_image);
-
-                for (size_t i = 0; i < (new_image.height + win.ch - 1) / win.ch; ++i)
+                if (selected(i, y))
                 {
-                    tclearregion(term.c.x, term.c.y, term.c.x + (new_image.width + win.cw - 1) / win.cw, term.c.y);
-                    tnewline(1);
+                    selclear();
+                    break;
                 }
-                return;
             }
-            term.esc &= ~(ESC_START | ESC_STR | ESC_DCS);
-            term.esc |= ESC_STR_END;
-            goto check_control_code;
         }
 
-        if (IS_SET(MODE_SIXEL))
+        if ((gp[x].mode & ATTR_WDUMMY) && x > 0)
         {
-            /* TODO: implement sixel mode */
-            sixel += (char)u;
-            return;
+            gp[x - 1].u = ' ';
+            gp[x - 1].mode &= ~ATTR_WIDE;
+        }
+        if ((gp[x + n - 1].mode & ATTR_WIDE) && x + n < term.col)
+        {
+            gp[x + n].u = ' ';
+            gp[x + n].mode &= ~ATTR_WDUMMY;
+        }
+        for (i = 0; i < n; i++)
+        {
+            gp[x + i]   = term.c.attr;
+            gp[x + i].u = (uchar)s[i];
         }
-        if ((term.esc & ESC_DCS) != 0 && strescseq.len == 0 && u == 'q')
-            term.mode |= MODE_SIXEL;
+        tsetdirtspan(y, x - 1, x + n);
+        term.lastc = (uchar)s[n - 1];
 
-        if (strescseq.len + len >= strescseq.buf.length())
+        if (x + n < term.col)
+        {
+            tmoveto(x + n, y);
+        }
+        else
         {
-            /*
-             * Here is a bug in terminals. If the user never sends
-             * some code to stop the str or esc command, then st
-             * will stop responding. But this is better than
-             * silently failing with unknown characters. At least
-             * then users will report back.
-             *
-             * In the case users ever get fixed, here is the code:
-             */
-            /*
-             * term.esc = 0;
-             * strhandle();
-             */
-            if (strescseq.buf.length() > (SIZE_MAX - UTF_SIZ) / 2)
-                return;
-            strescseq.buf.resize(strescseq.buf.length() * 2);
+            tmoveto(term.col - 1, y);
+            term.c.state |= CURSOR_WRAPNEXT;
         }
 
-        strescseq.buf.resize(strescseq.buf.length() + len);
-        for (int a = 0; a < len; a++)
-            strescseq.buf[strescseq.len + a] = c[a];
-        strescseq.len += len;
-        return;
+        s += n;
+        len -= n;
     }
+}
 
-check_control_code:
-    /*
-     * Actions of control codes must be performed as soon they arrive
-     * because they can be embedded inside a control sequence, and
-     * they must not cause conflicts with sequences.
-     */
-    if (control)
-    {
-        tcontrolcode(u);
-        /*
-         * control codes are not shown ever
-         */
-        if (!term.esc)
-            term.lastc = 0;
-        return;
-    }
-    else if (term.esc & ESC_START)
+/*
+ * Like tputascii for UTF-8 text, up to the first ASCII byte or anything
+ * that is not a printable character. Returns the bytes written.
+ */
+int Con::tpututf8(char const* s, int len)
+{
+    Glyph * gp, *line = NULL;
+    Rune    u;
+    uint8_t p;
+    int     n, i, x, y = -1, width;
+
+    for (i = 0; i < len && (s[i] & 0x80); i += n)
     {
-        if (term.esc & ESC_CSI)
+        if ((n = utf8decode(s + i, u, len - i)) == 0)
+            break;
+        p     = uniprop(u);
+        width = p & UNI_WIDTH;
+        if (width == 0)
+            break;
+
+        if (IS_SET(MODE_WRAP) && (term.c.state & CURSOR_WRAPNEXT))
+        {
+            term.line[term.c.y][term.c.x].mode |= ATTR_WRAP;
+            tnewline(1);
+            y = -1;
+        }
+        if (term.c.x + width > term.col)
+        {
+            tnewline(1);
+            y = -1;
+        }
+
+        if (y != term.c.y)
+        {
+            y    = term.c.y;
+            line = term.line[y];
+        }
+        x  = term.c.x;
+        gp = &line[x];
+
+        if (sel.ob.x != -1 && selected(x, y))
+            selclear();
+
+        if ((gp->mode & ATTR_WIDE) && x + 1 < term.col)
+        {
+            gp[1].u = ' ';
+            gp[1].mode &= ~ATTR_WDUMMY;
+        }
+        else if (gp->mode & ATTR_WDUMMY)
         {
-            csiescseq.buf[csiescseq.len++] = u;
-            if (BETWEEN(u, 0x40, 0x7E) || csiescseq.len >= sizeof(csiescseq.buf) - 1)
+            gp[-1].u = ' ';
+            gp[-1].mode &= ~ATTR_WIDE;
+        }
+
+        *gp   = term.c.attr;
+        gp->u = u;
+        if ((p & (UNI_BOXDRAW | UNI_BRAILLE)) && isboxdraw(u))
+            gp->mode |= ATTR_BOXDRAW;
+        if (width == 2)
+        {
+            gp->mode |= ATTR_WIDE;
+            if (x + 1 < term.col)
             {
-                term.esc = 0;
-                csiparse();
-                csihandle();
+                gp[1].u    = '\0';
+                gp[1].mode = ATTR_WDUMMY;
             }
-            return;
         }
-        else if (term.esc & ESC_UTF8)
+        tsetdirtspan(y, x - 1, x + width);
+        term.lastc = u;
+
+        if (x + width < term.col)
         {
-            tdefutf8(u);
+            term.c.x = x + width;
+            term.c.state &= ~CURSOR_WRAPNEXT;
         }
-        else if (term.esc & ESC_ALTCHARSET)
+        else
         {
-            tdeftran(u);
+            term.c.state |= CURSOR_WRAPNEXT;
         }
-        else if (term.esc & ESC_TEST)
+    }
+    return i;
+}
+
+/* cells an image takes up */
+static long long imgcols(Image const& im)
+{
+    return DIVCEIL((long long)im.width, win.cw);
+}
+
+static long long imgrows(Image const& im)
+{
+    return DIVCEIL((long long)im.height, win.ch);
+}
+
+/*
+ * Place an image with its top edge on row y, counted like term.rowbase. It
+ * replaces the ones it covers. Past imagemem the images drawn least recently
+ * go, never the new one.
+ */
+void Con::timgadd(long long y, Image&& im)
+{
+    ImageMap::iterator it, lru, added;
+    long long          top = y - term.rowbase;
+
+    timgclear(im.x, top, im.x + imgcols(im) - 1, top + imgrows(im) - 1);
+    term.imgmem += im.bytes();
+    term.imgh = MAX(term.imgh, im.height);
+    added     = term.images.emplace(y, std::move(im));
+
+    while (term.imgmem > (size_t)imagemem << 20 && term.images.size() > 1)
+    {
+        lru = term.images.end();
+        for (it = term.images.begin(); it != term.images.end(); ++it)
         {
-            tdectest(u);
+            if (it != added && (lru == term.images.end() || it->second.used < lru->second.used))
+                lru = it;
         }
+        timgdel(lru);
+    }
+}
+
+/* free the image at it, which moves on to the next one */
+void Con::timgdel(ImageMap::iterator& it)
+{
+    Image&    im  = it->second;
+    long long top = it->first - term.rowbase + term.scr, y;
+
+    xfreesixel(im);
+    /* the text under it has to be drawn again */
+    for (y = MAX(top, 0LL); im.alt == IS_SET(MODE_ALTSCREEN) && y < top + imgrows(im) && y < term.row; y++)
+    {
+        term.drawn[y] = 0;
+        tsetdirt(y, y);
+    }
+    term.imgmem -= im.bytes();
+    it = term.images.erase(it);
+}
+
+/*
+ * Erasing the cells under the part of an image on screen erases the
+ * image, its top may have scrolled off already.
+ */
+void Con::timgclear(int x1, int y1, int x2, int y2)
+{
+    ImageMap::iterator it;
+    long long          top, bot, right;
+
+    it = term.images.lower_bound(term.rowbase + y1 - DIVCEIL((long long)term.imgh, win.ch) + 1);
+    while (it != term.images.end() && it->first <= term.rowbase + y2)
+    {
+        Image const& im = it->second;
+
+        top   = it->first - term.rowbase;
+        bot   = MIN(top + imgrows(im), (long long)term.row) - 1;
+        right = MIN((long long)im.x + imgcols(im), (long long)term.col) - 1;
+        if (im.alt == IS_SET(MODE_ALTSCREEN) && (long long)im.x >= x1 && right <= x2 && MAX(top, 0LL) >= y1 && bot <= y2)
+            timgdel(it);
+        else
+            ++it;
+    }
+}
+
+/*
+ * Rows top to bot moved down by n rows, up when n is negative. The images
+ * on them move along and the ones moved out of those rows go.
+ */
+void Con::timgmove(int top, int bot, int n)
+{
+    std::vector<ImageMap::node_type> moved;
+    ImageMap::iterator               it;
+    long long                        y;
+
+    it = term.images.lower_bound(term.rowbase + top - DIVCEIL((long long)term.imgh, win.ch) + 1);
+    while (it != term.images.end() && it->first <= term.rowbase + bot)
+    {
+        y = it->first - term.rowbase;
+        if (it->second.alt != IS_SET(MODE_ALTSCREEN) || y + imgrows(it->second) <= top)
+            ++it;
+        else if (y + n > bot || y + n + imgrows(it->second) <= top)
+            timgdel(it);
         else
+            moved.push_back(term.images.extract(it++));
+    }
+    for (auto& node : moved)
+    {
+        node.key() += n;
+        term.images.insert(std::move(node));
+    }
+}
+
+/*
+ * n rows went off the top of the screen, into the history when kept. The
+ * images that went with them are tied to the line their bottom edge ended
+ * up in and go with it. Rows not kept take their images along right away.
+ */
+void Con::timgscrolled(int n, int kept)
+{
+    ImageMap::iterator it;
+    long long          seq = term.hist.base + term.hist.nlines - 1;
+
+    if (term.hist.nlines == 0)
+        kept = 0;
+
+    it = term.images.lower_bound(term.rowbase - n - DIVCEIL((long long)term.imgh, win.ch));
+    while (it != term.images.end() && it->first < term.rowbase)
+    {
+        Image& im = it->second;
+
+        if (im.seq < 0 && !im.alt && it->first + imgrows(im) <= term.rowbase)
+        {
+            if (!kept)
+            {
+                timgdel(it);
+                continue;
+            }
+            im.seq = seq;
+        }
+        ++it;
+    }
+
+    /* images are ordered by row, not by line, any of them may have expired */
+    it = term.images.begin();
+    while (it != term.images.end())
+    {
+        if (it->second.seq >= 0 && it->second.seq < term.hist.base)
+            timgdel(it);
+        else
+            ++it;
+    }
+}
+
+void Con::tputc(Rune u)
+{
+    char          c[UTF_SIZ];
+    int           width, len;
+    Glyph*        gp;
+    EscTransition t;
+
+    if (u < 127 || !IS_SET(MODE_UTF8 | MODE_SIXEL))
+    {
+        c[0]  = u;
+        width = len = 1;
+    }
+    else
+    {
+        len   = utf8encode(u, c);
+        width = uniwidth(u);
+    }
+
+    if (IS_SET(MODE_PRINT))
+        tprinter(c, len);
+
+    t = esctable[term.esc][u < 0x100 ? u : 0xa0];
+
+    /* a sixel image is shown once its string is terminated, CAN, SUB or a new sequence drop it */
+    if (term.esc >= ESC_STR && t.next < ESC_STR && IS_SET(MODE_SIXEL))
+    {
+        term.mode &= ~MODE_SIXEL;
+        strreset();
+        if (t.action != ACT_STR_END)
         {
-            if (!eschandle(u))
-                return;
-            /* sequence already finished */
+            sixel.cancel();
         }
-        term.esc = 0;
+        else
+        {
+            t.action = ACT_NONE;
+
+            Image new_image{
+                .x   = static_cast<size_t>(term.c.x),
+                .alt = IS_SET(MODE_ALTSCREEN),
+            };
+            std::tie(new_image.data, new_image.width, new_image.height) = sixel.finish();
+
+            /* nothing drawn or too large */
+            if (new_image.width > 0 && new_image.height > 0)
+            {
+                long long rows = imgrows(new_image), cols = imgcols(new_image);
+
+                /* placed first, so it moves up with the rows the cursor scrolls */
+                timgadd(term.rowbase + term.c.y, std::move(new_image));
+                for (long long i = 0; i < rows; ++i)
+                {
+                    tclearregion(term.c.x, term.c.y, term.c.x + cols, term.c.y);
+                    tnewline(1);
+                }
+            }
+        }
+    }
+    term.esc = t.next;
+
+    switch (t.action)
+    {
+    case ACT_PRINT:
+        /* there is no cell to put zero width characters in */
+        if (width == 0)
+            return;
+        break;
+
+    case ACT_EXECUTE:
+        /*
+         * Actions of control codes must be performed as soon they arrive
+         * because they can be embedded inside a control sequence, and
+         * they must not cause conflicts with sequences.
+         */
+        tcontrolcode(u);
+        /*
+         * control codes are not shown ever
+         */
+        if (!term.esc)
+            term.lastc = 0;
+        return;
+
+    case ACT_CLEAR:
+        csireset();
+        return;
+
+    case ACT_COLLECT:
+        csicollect(u);
+        return;
+
+    case ACT_PARAM:
+        csiparam(u);
+        return;
+
+    case ACT_ESC_DISPATCH:
+        eschandle(u);
+        return;
+
+    case ACT_CSI_DISPATCH:
+        csiescseq.mode = u;
+        csihandle();
+        return;
+
+    case ACT_STR_START:
+        tstrsequence(u);
+        return;
+
+    case ACT_STR_PUT:
+        strput(c, len);
+        return;
+
+    case ACT_STR_END:
+        strhandle();
+        strreset();
+        return;
+
+    default:
         /*
          * All characters which form part of a sequence are not
          * printed
          */
         return;
     }
+
     if (selected(term.c.x, term.c.y))
         selclear();
 
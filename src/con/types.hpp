@@ -5,15 +5,25 @@
 
 constexpr auto ESC_BUF_SIZ = (128 * UTF_SIZ);
 constexpr auto ESC_ARG_SIZ = 16;
+constexpr auto ESC_ARG_MAX = 65535; // larger parameters are clamped
 constexpr auto CAR_PER_ARG = 4;
 constexpr auto STR_BUF_SIZ = ESC_BUF_SIZ;
 constexpr auto STR_ARG_SIZ = ESC_ARG_SIZ;
-constexpr auto HISTSIZE    = 2000;
+constexpr auto HIST_HOT    = 1024; // newest history lines kept as cells
+constexpr auto HIST_BLOCK  = 256;  // lines per compressed history block
+constexpr auto HIST_CACHE  = 4;    // inflated history blocks kept around
+constexpr auto HIST_REFLOW = 4096; // history rows a resize rewraps at most
 
+#include <climits>
 #include <vector>
+#include <deque>
+#include <map>
+#include <unordered_map>
+#include <functional>
 #include <array>
 #include <string>
 #include <string_view>
+#include <type_traits>
 
 #if !defined(_WIN32)
 #include <pwd.h>
@@ -56,18 +66,205 @@ namespace winrt
 
 #endif
 
+// Attributes too rare to be worth a slot in every cell. They are interned
+// per terminal in Term::extras and cells refer to them by index, 0 being
+// the entry with nothing set.
+struct GlyphExtra
+{
+    int ustyle;    // underline style
+    int ucolor[3]; // underline color
+
+    bool operator==(GlyphExtra const&) const = default;
+};
+
+struct GlyphExtraHash
+{
+    size_t operator()(GlyphExtra const& e) const
+    {
+        uint64_t h = (uint32_t)e.ustyle;
+
+        for (int c : e.ucolor)
+            h = (h ^ (uint32_t)c) * 0x9e3779b97f4a7c15;
+        return h ^ (h >> 32);
+    }
+};
+
+using ExtraIndex = std::unordered_map<GlyphExtra, ushort, GlyphExtraHash>;
+
 struct Glyph
 {
-    Rune                  u;          // character code
-    ushort                mode;       // attribute flags
-    uint32_t              fg;         // foreground
-    uint32_t              bg;         // background
-    int                   ustyle;     // underline style
-    int                   ucolor[3];  // underline color
-    std::vector<uint32_t> sixel_data; // sixel data
+    Rune     u;     // character code
+    ushort   mode;  // attribute flags
+    ushort   extra; // index into Term::extras
+    uint32_t fg;    // foreground
+    uint32_t bg;    // background
+};
+
+// Lines get moved around with memmove/memcpy, keep it that way.
+static_assert(std::is_trivially_copyable_v<Glyph>);
+static_assert(sizeof(Glyph) == 16);
+
+using Line = Glyph*;
+
+struct History;
+
+// Wrapping a logical line at col: linecontent() is the number of cells up
+// to the last non blank one, linebreak() the end of the row starting at a
+// given cell and linerow() copies that row out. A wide glyph that does not
+// fit moves to the next row.
+int  linecontent(Glyph const*, int);
+int  linebreak(Glyph const*, int, int, int);
+void linerow(Glyph*, int, Glyph const*, int, int, int, Glyph const&);
+
+// A grid of cells stored as one contiguous arena. Rows are reached through
+// a ring of slot indices, so scrolling the whole grid only moves the ring
+// head and scrolling a region permutes row indices instead of copying cells.
+struct TScreen
+{
+    int                row  = 0; // nb rows
+    int                col  = 0; // nb cols
+    int                head = 0; // ring position of the first row
+    std::vector<int>   slots;    // ring position -> arena row
+    std::vector<Glyph> cells;    // row * col cells
+
+    Line operator[](int y)
+    {
+        return cells.data() + (size_t)slots[(head + y) % row] * col;
+    }
+
+    Glyph const* operator[](int y) const
+    {
+        return cells.data() + (size_t)slots[(head + y) % row] * col;
+    }
+
+    void resize(int, int, int);
+    void reflow(int, int, int*, int*, History&, Glyph const&);
+    void rotate(int, int, int);
 };
 
-using Line = std::vector<Glyph>;
+// Cells of a packed history line sharing the same attributes.
+struct HistSpan
+{
+    uint32_t len;
+    ushort   mode;
+    ushort   extra;
+    uint32_t fg;
+    uint32_t bg;
+};
+
+// HIST_BLOCK history lines packed as UTF-8 text plus attribute spans. The
+// spans cover every cell of a line, trailing blanks are left out of the text.
+// A spilled block has its arrays written back to back at off in the spill
+// file and nothing left in memory.
+struct HistBlock
+{
+    struct Index
+    {
+        uint32_t text;
+        uint32_t span;
+    };
+
+    int                   id;        // key in the inflate cache
+    int                   first;     // lines already dropped from the front
+    std::vector<Index>    lines;     // HIST_BLOCK + 1 offsets
+    std::vector<HistSpan> spans;
+    std::string           text;
+    long long             off  = -1; // offset in the spill file, -1 if in memory
+    size_t                size = 0;  // bytes in the spill file
+
+    size_t bytes(void) const;
+};
+
+// Scrollback, oldest line first. History keeps logical lines, soft wrapped
+// rows are joined as they scroll off, and hands out rows wrapped at col.
+// Storage for a line is only allocated when it scrolls off the screen. The
+// newest HIST_HOT lines are kept as cells in a ring, older ones are packed
+// into blocks and inflated when looked at.
+//
+// Rows are found through an index built from the newest line backwards. A
+// resize only throws the index away, rows() rebuilds as much of it as is
+// about to be shown, so rewrapping costs nothing for lines never scrolled to.
+// The index only counts the rows of every HIST_BLOCK lines, where each row
+// starts is worked out again for the few chunks being looked at.
+struct History
+{
+    struct Row
+    {
+        long long seq;   // line
+        int       start; // first cell of the row in the line
+    };
+
+    struct Chunk
+    {
+        long long seq;   // first line, chunks never cross a multiple of HIST_BLOCK
+        int       lines; // nb lines
+        int       rows;  // nb rows they wrap to
+        long long row;   // first row, counted from an arbitrary origin
+    };
+
+    struct Wrapped
+    {
+        Chunk            chunk = {-1, 0, 0, 0}; // what rows was built for
+        int              col   = 0;             //
+        unsigned         used  = 0;             // tick of the last lookup
+        std::vector<Row> rows;                  // rows of the chunk's lines
+    };
+
+    struct Inflated
+    {
+        int                   id   = -1; // block id, -1 when unused
+        unsigned              used = 0;  // tick of the last lookup
+        std::vector<Glyph>    cells;     // the block's lines back to back
+        std::vector<uint32_t> start;     // HIST_BLOCK + 1 offsets into cells
+    };
+
+    struct Rendered
+    {
+        Row                row  = {-1, 0};
+        unsigned           gen  = 0;
+        unsigned           used = 0;
+        std::vector<Glyph> cells;
+    };
+
+    int                              max      = 0;  // line limit, negative for none
+    size_t                           cap      = 0;  // byte limit, 0 for none
+    size_t                           spill    = 0;  // bytes kept in memory before spilling, 0 for never
+    size_t                           mem      = 0;  // bytes held in memory by lines and blocks
+    int                              fd       = -1; // spill file
+    long long                        end      = 0;  // end of the spill file
+    size_t                           nspill   = 0;  // nb spilled blocks, always the oldest
+    int                              col      = 0;  // width rows are wrapped at
+    Glyph                            fill     = {}; // pads rows past the end of a line
+    long long                        base     = 0;  // seq of the oldest line
+    int                              nlines   = 0;  // nb lines
+    int                              hot      = 0;  // nb lines in the ring
+    int                              head     = 0;  // ring index of the oldest hot line
+    std::vector<std::vector<Glyph>>  ring;          // hot lines, grown on demand
+    std::deque<HistBlock>            blocks;        // cold lines, oldest first
+    long long                        frontier = 0;  // seq of the oldest line in index
+    std::deque<Chunk>                index;         // rows of the lines from frontier on
+    int                              len      = 0;  // nb rows in index
+    int                              last     = 0;  // start of the last row of the newest line
+    int                              nextid   = 0;  // id of the next block
+    unsigned                         tick     = 0;  // cache clock
+    unsigned                         gen      = 0;  // bumped whenever rows may change
+    std::array<Inflated, HIST_CACHE> cache;         // recently inflated blocks
+    std::array<Rendered, HIST_CACHE> rendered;      // recently handed out rows
+    std::array<Wrapped, HIST_CACHE>  wrapped;       // recently looked up chunks
+
+    Line         operator[](int);
+    int          rows(int);
+    void         push(Glyph const*);
+    void         resize(int, Glyph const&);
+    void         pack(void);
+    void         drop(void);
+    void         wrap(long long, int, std::vector<Row>&);
+    int          nrows(long long);
+    Row          row(int);
+    void         spillblock(HistBlock&);
+    Glyph const* line(long long, int*);
+    void         visitextras(std::function<void(ushort&)> const&);
+};
 
 struct TCursor
 {
@@ -95,64 +292,106 @@ struct Selection
     } nb, ne, ob, oe;
 };
 
+// Rows top to bot moved up by n rows, down when n is negative, since the
+// last frame. The window does the same with what it already shows.
+struct TScroll
+{
+    int top; //
+    int bot; //
+    int n;   //
+};
+
+// Columns x1 to x2 of a row changed since it was last drawn, none when
+// x1 > x2.
+struct DirtySpan
+{
+    int x1 = INT_MAX; //
+    int x2 = -1;      //
+};
+
+// A sixel image placed on the screen. It moves with the rows it was drawn
+// over, up into the history along with the text, and goes away with the
+// history line its bottom edge ends up in.
 struct Image
 {
-    size_t                x;                  //
-    size_t                y;                  //
-    size_t                width;              //
+    size_t                x;                  // column of the left edge
+    size_t                width;              // in pixels
     size_t                height;             //
-    std::vector<uint32_t> data;               //
-    void*                 drawable = nullptr; //
+    long long             seq      = -1;      // history line of the bottom edge, -1 while on screen
+    int                   alt      = 0;       // drawn on the alternate screen
+    std::vector<uint32_t> data;               // pixels, released once uploaded
+    void*                 drawable = nullptr; // uploaded copy, window side
+    void*                 gc       = nullptr; // clipped to clip, window side
+    std::array<int, 4>    clip     = {};      // x, y, width and height of the part shown
+    unsigned              used     = 0;       // Term::imgtick when last drawn
+
+    size_t bytes(void) const
+    {
+        return width * height * sizeof(uint32_t);
+    }
 };
 
+// Images by the row of their top edge, counted from the first row of the
+// terminal like Term::rowbase, so finding the ones in view is a lookup.
+using ImageMap = std::multimap<long long, Image>;
+
 struct Term
 {
     int                        row;      // nb row
     int                        col;      // nb col
-    std::vector<Line>          line;     // screen
-    std::vector<Line>          alt;      // alternate screen
-    std::array<Line, HISTSIZE> hist;     // history buffer
-    int                        histi;    // history index
+    TScreen                    line;     // screen
+    TScreen                    alt;      // alternate screen
+    History                    hist;     // history buffer, newest line last
     int                        scr;      // scroll back
-    std::vector<int>           dirty;    // dirtyness of lines
+    std::vector<DirtySpan>     dirty;    // changed columns of lines
+    std::vector<uint64_t>      drawn;    // hash of lines as last drawn, 0 if unknown
+    std::vector<TScroll>       scrolls;  // moves not drawn yet, oldest first
     TCursor                    c;        // cursor
+    std::array<TCursor, 2>     saved;    // cursors saved on the main and alt screen
     int                        ocx;      // old cursor col
     int                        ocy;      // old cursor row
     int                        top;      // top    scroll limit
     int                        bot;      // bottom scroll limit
     int                        mode;     // terminal mode flags
-    int                        esc;      // escape state flags
+    int                        esc;      // parser state, escape_state
     std::array<char, 4>        trantbl;  // charset table translation
     int                        charset;  // current charset
     int                        icharset; // selected charset for sequence
     std::vector<int>           tabs;     //
     Rune                       lastc;    // last printed char outside of sequence, 0 if control
-    std::vector<Image>         images;   //
+    ImageMap                   images;   // placed images
+    size_t                     imgmem;   // bytes taken by images
+    size_t                     imgh;     // height of the tallest image, in pixels
+    unsigned                   imgtick;  // bumped every frame images are drawn in
+    long long                  rowbase;  // rows scrolled off the top of the screen so far
+    std::vector<GlyphExtra>    extras;   // interned rare attributes
+    ExtraIndex                 extraidx; // where each of extras is
 };
 
-// CSI Escape sequence structs
-// ESC '[' [[ [<priv>] <arg> [;]] <mode> [<mode>]]
+// CSI Escape sequence structs, filled in as the sequence comes in. ESC
+// sequences only use the intermediates.
+// ESC '[' [<priv>] [<arg> [:<carg>] [;]] [<inter>] <mode>
 struct CSIEscape
 {
-    std::array<char, ESC_BUF_SIZ>                         buf;  // raw string
-    size_t                                                len;  // raw string length
-    char                                                  priv; //
-    std::array<int, ESC_ARG_SIZ>                          arg;  //
-    int                                                   narg; // nb of args
-    std::array<char, 2>                                   mode; //
-    std::array<std::array<int, ESC_ARG_SIZ>, CAR_PER_ARG> carg; // colon args
+    char                                                  priv;  // private marker
+    std::array<char, 2>                                   inter; // intermediates
+    char                                                  mode;  // final byte
+    std::array<int, ESC_ARG_SIZ>                          arg;   //
+    int                                                   narg;  // nb of args, the last one being read
+    int                                                   ncarg; // colon arg being read, -1 for none
+    std::array<std::array<int, CAR_PER_ARG>, ESC_ARG_SIZ> carg;  // colon args, -1 if not given
 };
 
 // STR Escape sequence structs
 // ESC type [[ [<priv>] <arg> [;]] <mode>] ESC '\'
 struct STREscape
 {
-    std::array<char, 64>           pad;  //
-    char                           type; // ESC type ...
-    std::string                    buf;  // 
-    size_t                         len;  // raw string length
-    std::array<char*, STR_ARG_SIZ> argp; // pointers to the end of nth argument
-    int                            narg; // nb of args
+    char                           type;    // ESC type ...
+    std::string                    buf;     // raw string
+    size_t                         max;     // longest string kept for this type
+    int                            dropped; // longer than max, ignored up to its end
+    std::array<char*, STR_ARG_SIZ> argp;    // pointers to the end of nth argument
+    int                            narg;    // nb of args
 };
 
 struct Pty
@@ -23,6 +23,31 @@ inline char const*        utmp  = NULL;
 inline char const* scroll    = NULL;
 inline char const* stty_args = "stty raw pass8 nl -echo -iexten -cstopb 38400";
 
+/*
+ * scrollback: number of lines kept, a negative value keeps every line.
+ * histmem caps the memory used by it in megabytes, 0 means no cap.
+ * Past histspill megabytes the oldest lines are moved to an unlinked
+ * temporary file in $TMPDIR and mapped back when scrolled to, 0 keeps
+ * everything in memory.
+ */
+inline int          histsize  = 2000;
+inline unsigned int histmem   = 0;
+inline unsigned int histspill = 64;
+
+/*
+ * longest OSC and DCS strings accepted, in bytes. Longer ones are dropped
+ * whole. OSC 52 carries the clipboard base64 encoded and DCS sixel images,
+ * those are decoded as they come in and dcsmax bounds the decoded image.
+ */
+inline unsigned int oscmax = 8 << 20;
+inline unsigned int dcsmax = 64 << 20;
+
+/*
+ * memory for sixel images, in MiB. Past it the images drawn least recently
+ * are thrown away, whether on screen or in the history.
+ */
+inline unsigned int imagemem = 256;
+
 /* identification sequence returned in DA and DECID */
 inline char const* vtiden = "\033[?63;4";
 
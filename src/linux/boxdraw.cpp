@@ -8,9 +8,13 @@
 #undef Glyph
 #include "st.h"
 #include "con/con.hpp"
+#include "unicode.hpp"
 #include "boxdraw_data.h"
 #include "config.hpp"
 
+#include <bitset>
+#include <vector>
+
 int    isboxdraw(Rune);
 ushort boxdrawindex(Glyph const*);
 
@@ -25,8 +29,22 @@ static Colormap xcmap;
 static XftDraw* xd;
 static Visual*  xvis;
 
-static void drawbox(int, int, int, int, XftColor*, XftColor*, ushort);
-static void drawboxlines(int, int, int, int, XftColor*, ushort);
+/*
+ * The shapes are rasterised once into an alpha mask glyph set, for the
+ * current cell size. The glyph id is the shape data, bold included.
+ */
+static GlyphSet              boxglyphs = 0;
+static int                   boxw, boxh;
+static std::bitset<1 << 16>  boxloaded;
+static std::vector<uint8_t>  boxmask; /* shape being rasterised, A8 */
+static uint8_t               boxalpha;
+static std::vector<unsigned> boxstring;
+
+static void boxatlas(int, int);
+static void boxglyph(ushort);
+static void boxrect(int, int, int, int);
+static void drawbox(int, int, int, int, ushort);
+static void drawboxlines(int, int, int, int, ushort);
 
 /* public API */
 
@@ -39,8 +57,8 @@ void boxdraw_xinit(Display* dpy, Colormap cmap, XftDraw* draw, Visual* vis)
 
 int isboxdraw(Rune u)
 {
-    Rune block = u & ~0xff;
-    return (boxdraw && block == 0x2500 && boxdata[(uint8_t)u]) || (boxdraw_braille && block == 0x2800);
+    uint8_t p = uniprop(u);
+    return (boxdraw && (p & UNI_BOXDRAW) && boxdata[(uint8_t)u]) || (boxdraw_braille && (p & UNI_BRAILLE));
 }
 
 /* the "index" is actually the entire shape data encoded as ushort */
@@ -53,71 +71,115 @@ ushort boxdrawindex(Glyph const* g)
     return boxdata[(uint8_t)g->u];
 }
 
+/* the background is drawn already, the shapes go over it in one request */
 void drawboxes(int x, int y, int cw, int ch, XftColor* fg, XftColor* bg, XftGlyphFontSpec const* specs, int len)
 {
-    for (; len-- > 0; x += cw, specs++)
-        drawbox(x, y, cw, ch, fg, bg, (ushort)specs->glyph);
+    int i;
+
+    if (!boxglyphs || cw != boxw || ch != boxh)
+        boxatlas(cw, ch);
+
+    boxstring.resize(len);
+    for (i = 0; i < len; i++)
+    {
+        boxstring[i] = (ushort)specs[i].glyph;
+        if (!boxloaded[boxstring[i]])
+            boxglyph(boxstring[i]);
+    }
+
+    XRenderCompositeString32(xdpy, PictOpOver, XftDrawSrcPicture(xd, fg), XftDrawPicture(xd), 0, boxglyphs, 0, 0, x, y, boxstring.data(), len);
 }
 
 /* implementation */
 
-void drawbox(int x, int y, int w, int h, XftColor* fg, XftColor* bg, ushort bd)
+/* a new glyph set, on start up and when the font size changes */
+void boxatlas(int w, int h)
+{
+    if (boxglyphs)
+        XRenderFreeGlyphSet(xdpy, boxglyphs);
+    boxglyphs = XRenderCreateGlyphSet(xdpy, XRenderFindStandardFormat(xdpy, PictStandardA8));
+    boxw      = w;
+    boxh      = h;
+    boxloaded.reset();
+}
+
+void boxglyph(ushort bd)
+{
+    XGlyphInfo info = {.width = (unsigned short)boxw, .height = (unsigned short)boxh, .x = 0, .y = 0, .xOff = (short)boxw, .yOff = 0};
+    Glyph_     gid  = bd;
+
+    /* rows are padded to 32 bits */
+    boxmask.assign(((boxw + 3) & ~3) * boxh, 0);
+    boxalpha = 0xff;
+    drawbox(0, 0, boxw, boxh, bd);
+
+    XRenderAddGlyphs(xdpy, boxglyphs, &gid, &info, 1, (char const*)boxmask.data(), boxmask.size());
+    boxloaded.set(bd);
+}
+
+/* fill a rectangle of the mask with boxalpha */
+void boxrect(int x, int y, int w, int h)
+{
+    int stride = (boxw + 3) & ~3;
+    int x2 = MIN(x + w, boxw), y2 = MIN(y + h, boxh);
+
+    x = MAX(x, 0);
+    y = MAX(y, 0);
+    for (; y < y2; y++)
+    {
+        if (x < x2)
+            memset(&boxmask[y * stride + x], boxalpha, x2 - x);
+    }
+}
+
+void drawbox(int x, int y, int w, int h, ushort bd)
 {
     ushort cat = bd & ~(BDB | 0xff); /* mask out bold and data */
     if (bd & (BDL | BDA))
     {
         /* lines (light/double/heavy/arcs) */
-        drawboxlines(x, y, w, h, fg, bd);
+        drawboxlines(x, y, w, h, bd);
     }
     else if (cat == BBD)
     {
         /* lower (8-X)/8 block */
         int d = DIV((uint8_t)bd * h, 8);
-        XftDrawRect(xd, fg, x, y + d, w, h - d);
+        boxrect(x, y + d, w, h - d);
     }
     else if (cat == BBU)
     {
         /* upper X/8 block */
-        XftDrawRect(xd, fg, x, y, w, DIV((uint8_t)bd * h, 8));
+        boxrect(x, y, w, DIV((uint8_t)bd * h, 8));
     }
     else if (cat == BBL)
     {
         /* left X/8 block */
-        XftDrawRect(xd, fg, x, y, DIV((uint8_t)bd * w, 8), h);
+        boxrect(x, y, DIV((uint8_t)bd * w, 8), h);
     }
     else if (cat == BBR)
     {
         /* right (8-X)/8 block */
         int d = DIV((uint8_t)bd * w, 8);
-        XftDrawRect(xd, fg, x + d, y, w - d, h);
+        boxrect(x + d, y, w - d, h);
     }
     else if (cat == BBQ)
     {
         /* Quadrants */
         int w2 = DIV(w, 2), h2 = DIV(h, 2);
         if (bd & TL)
-            XftDrawRect(xd, fg, x, y, w2, h2);
+            boxrect(x, y, w2, h2);
         if (bd & TR)
-            XftDrawRect(xd, fg, x + w2, y, w - w2, h2);
+            boxrect(x + w2, y, w - w2, h2);
         if (bd & BL)
-            XftDrawRect(xd, fg, x, y + h2, w2, h - h2);
+            boxrect(x, y + h2, w2, h - h2);
         if (bd & BR)
-            XftDrawRect(xd, fg, x + w2, y + h2, w - w2, h - h2);
+            boxrect(x + w2, y + h2, w - w2, h - h2);
     }
     else if (bd & BBS)
     {
         /* Shades - data is 1/2/3 for 25%/50%/75% alpha, respectively */
-        int          d = (uint8_t)bd;
-        XftColor     xfc;
-        XRenderColor xrc = {.alpha = 0xffff};
-
-        xrc.red   = DIV(fg->color.red * d + bg->color.red * (4 - d), 4);
-        xrc.green = DIV(fg->color.green * d + bg->color.green * (4 - d), 4);
-        xrc.blue  = DIV(fg->color.blue * d + bg->color.blue * (4 - d), 4);
-
-        XftColorAllocValue(xdpy, xvis, xcmap, &xrc, &xfc);
-        XftDrawRect(xd, &xfc, x, y, w, h);
-        XftColorFree(xdpy, xvis, xcmap, &xfc);
+        boxalpha = DIV(0xff * (uint8_t)bd, 4);
+        boxrect(x, y, w, h);
     }
     else if (cat == BRL)
     {
@@ -126,25 +188,25 @@ void drawbox(int x, int y, int w, int h, XftColor* fg, XftColor* bg, ushort bd)
         int h1 = DIV(h, 4), h2 = DIV(h, 2), h3 = DIV(3 * h, 4);
 
         if (bd & 1)
-            XftDrawRect(xd, fg, x, y, w1, h1);
+            boxrect(x, y, w1, h1);
         if (bd & 2)
-            XftDrawRect(xd, fg, x, y + h1, w1, h2 - h1);
+            boxrect(x, y + h1, w1, h2 - h1);
         if (bd & 4)
-            XftDrawRect(xd, fg, x, y + h2, w1, h3 - h2);
+            boxrect(x, y + h2, w1, h3 - h2);
         if (bd & 8)
-            XftDrawRect(xd, fg, x + w1, y, w - w1, h1);
+            boxrect(x + w1, y, w - w1, h1);
         if (bd & 16)
-            XftDrawRect(xd, fg, x + w1, y + h1, w - w1, h2 - h1);
+            boxrect(x + w1, y + h1, w - w1, h2 - h1);
         if (bd & 32)
-            XftDrawRect(xd, fg, x + w1, y + h2, w - w1, h3 - h2);
+            boxrect(x + w1, y + h2, w - w1, h3 - h2);
         if (bd & 64)
-            XftDrawRect(xd, fg, x, y + h3, w1, h - h3);
+            boxrect(x, y + h3, w1, h - h3);
         if (bd & 128)
-            XftDrawRect(xd, fg, x + w1, y + h3, w - w1, h - h3);
+            boxrect(x + w1, y + h3, w - w1, h - h3);
     }
 }
 
-void drawboxlines(int x, int y, int w, int h, XftColor* fg, ushort bd)
+void drawboxlines(int x, int y, int w, int h, ushort bd)
 {
     /* s: stem thickness. width/8 roughly matches underscore thickness. */
     /* We draw bold as 1.5 * normal-stem and at least 1px thicker.      */
@@ -171,13 +233,13 @@ void drawboxlines(int x, int y, int w, int h, XftColor* fg, ushort bd)
         int d = arc || (multi_double && !multi_light) ? -s : 0;
 
         if (bd & LL)
-            XftDrawRect(xd, fg, x, y + h2, w2 + s + d, s);
+            boxrect(x, y + h2, w2 + s + d, s);
         if (bd & LU)
-            XftDrawRect(xd, fg, x + w2, y, s, h2 + s + d);
+            boxrect(x + w2, y, s, h2 + s + d);
         if (bd & LR)
-            XftDrawRect(xd, fg, x + w2 - d, y + h2, w - w2 + d, s);
+            boxrect(x + w2 - d, y + h2, w - w2 + d, s);
         if (bd & LD)
-            XftDrawRect(xd, fg, x + w2, y + h2 - d, s, h - h2 + d);
+            boxrect(x + w2, y + h2 - d, s, h - h2 + d);
     }
 
     /* double lines - also align with light to form heavy when combined */
@@ -194,26 +256,26 @@ void drawboxlines(int x, int y, int w, int h, XftColor* fg, ushort bd)
         if (dl)
         {
             int p = dd ? -s : 0, n = du ? -s : dd ? s : 0;
-            XftDrawRect(xd, fg, x, y + h2 + s, w2 + s + p, s);
-            XftDrawRect(xd, fg, x, y + h2 - s, w2 + s + n, s);
+            boxrect(x, y + h2 + s, w2 + s + p, s);
+            boxrect(x, y + h2 - s, w2 + s + n, s);
         }
         if (du)
         {
             int p = dl ? -s : 0, n = dr ? -s : dl ? s : 0;
-            XftDrawRect(xd, fg, x + w2 - s, y, s, h2 + s + p);
-            XftDrawRect(xd, fg, x + w2 + s, y, s, h2 + s + n);
+            boxrect(x + w2 - s, y, s, h2 + s + p);
+            boxrect(x + w2 + s, y, s, h2 + s + n);
         }
         if (dr)
         {
             int p = du ? -s : 0, n = dd ? -s : du ? s : 0;
-            XftDrawRect(xd, fg, x + w2 - p, y + h2 - s, w - w2 + p, s);
-            XftDrawRect(xd, fg, x + w2 - n, y + h2 + s, w - w2 + n, s);
+            boxrect(x + w2 - p, y + h2 - s, w - w2 + p, s);
+            boxrect(x + w2 - n, y + h2 + s, w - w2 + n, s);
         }
         if (dd)
         {
             int p = dr ? -s : 0, n = dl ? -s : dr ? s : 0;
-            XftDrawRect(xd, fg, x + w2 + s, y + h2 - p, s, h - h2 + p);
-            XftDrawRect(xd, fg, x + w2 - s, y + h2 - n, s, h - h2 + n);
+            boxrect(x + w2 + s, y + h2 - p, s, h - h2 + p);
+            boxrect(x + w2 - s, y + h2 - n, s, h - h2 + n);
         }
     }
 }
\ No newline at end of file
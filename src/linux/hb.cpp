@@ -1,31 +1,52 @@
 #define Glyph Glyph_
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
 #include <X11/Xft/Xft.h>
 #include <hb.h>
 #include <hb-ft.h>
+#include <hb-ot.h>
 #undef Glyph
 
 #include "st.h"
 #include "con/con.hpp"
 
+#include <string>
+#include <unordered_map>
+#include <vector>
+
 #define FEATURE(c1, c2, c3, c4)                                                                                                                                                    \
     {                                                                                                                                                                              \
         .tag = HB_TAG(c1, c2, c3, c4), .value = 1, .start = HB_FEATURE_GLOBAL_START, .end = HB_FEATURE_GLOBAL_END                                                                  \
     }
 
-void       hbtransformsegment(XftFont* xfont, Glyph const* string, hb_codepoint_t* codepoints, int start, int length);
-hb_font_t* hbfindfont(XftFont* match);
-
 typedef struct
 {
-    XftFont*   match;
     hb_font_t* font;
-} HbFontMatch;
+    int        liga; /* has GSUB features that form ligatures */
+} HbFont;
+
+void    hbtransformsegment(XftFont* xfont, Glyph const* string, hb_codepoint_t* codepoints, int start, int length);
+HbFont* hbfindfont(XftFont* match);
+int     hbcanligate(hb_face_t* face);
+
+/* HarfBuzz fonts by the Xft font they were made for. */
+static std::unordered_map<XftFont*, HbFont> hbfontcache;
+
+/*
+ * Shaped runs, the glyphs for a font and a run of codepoints. The key
+ * starts with the font pointer, it is emptied when it reaches
+ * HB_SHAPE_CACHE entries or a font goes away.
+ */
+#define HB_SHAPE_CACHE 4096
+
+static std::unordered_map<std::u32string, std::vector<hb_codepoint_t>> hbshapecache;
 
-static int          hbfontslen  = 0;
-static HbFontMatch* hbfontcache = NULL;
+/* reused by every line */
+static hb_buffer_t*                hbbuffer = NULL;
+static std::u32string              hbkey;
+static std::vector<hb_codepoint_t> hbcodepoints;
 
 /*
  * Replace 0 with a list of font features, wrapped in FEATURE macro, e.g.
@@ -35,46 +56,76 @@ hb_feature_t features[] = {0};
 
 void hbunloadfonts()
 {
-    for (int i = 0; i < hbfontslen; i++)
+    for (auto& [match, font] : hbfontcache)
     {
-        hb_font_destroy(hbfontcache[i].font);
-        XftUnlockFace(hbfontcache[i].match);
+        hb_font_destroy(font.font);
+        XftUnlockFace(match);
     }
+    hbfontcache.clear();
+    hbshapecache.clear();
+}
 
-    if (hbfontcache != NULL)
-    {
-        free(hbfontcache);
-        hbfontcache = NULL;
-    }
-    hbfontslen = 0;
+/* Drop the cached font for match before it is closed. */
+void hbunloadfont(XftFont* match)
+{
+    auto it = hbfontcache.find(match);
+
+    if (it == hbfontcache.end())
+        return;
+    hb_font_destroy(it->second.font);
+    XftUnlockFace(match);
+    hbfontcache.erase(it);
+    hbshapecache.clear();
 }
 
-hb_font_t* hbfindfont(XftFont* match)
+HbFont* hbfindfont(XftFont* match)
 {
-    for (int i = 0; i < hbfontslen; i++)
-    {
-        if (hbfontcache[i].match == match)
-            return hbfontcache[i].font;
-    }
+    auto it = hbfontcache.find(match);
+
+    if (it != hbfontcache.end())
+        return &it->second;
 
     /* Font not found in cache, caching it now. */
-    hbfontcache     = (HbFontMatch*)realloc(hbfontcache, sizeof(HbFontMatch) * (hbfontslen + 1));
     FT_Face    face = XftLockFace(match);
     hb_font_t* font = hb_ft_font_create(face, NULL);
     if (font == NULL)
         die("Failed to load Harfbuzz font.");
 
-    hbfontcache[hbfontslen].match = match;
-    hbfontcache[hbfontslen].font  = font;
-    hbfontslen += 1;
+    HbFont& f = hbfontcache[match];
+    f.font    = font;
+    f.liga    = hbcanligate(hb_font_get_face(font));
+    return &f;
+}
 
-    return font;
+/* Whether the font has any of the GSUB features that form ligatures. */
+int hbcanligate(hb_face_t* face)
+{
+    hb_tag_t     tags[64];
+    unsigned int start = 0, n, i;
+
+    do
+    {
+        n = std::size(tags);
+        hb_ot_layout_table_get_feature_tags(face, HB_OT_TAG_GSUB, start, &n, tags);
+        for (i = 0; i < n; i++)
+        {
+            if (tags[i] == HB_TAG('l', 'i', 'g', 'a') || tags[i] == HB_TAG('c', 'a', 'l', 't') || tags[i] == HB_TAG('d', 'l', 'i', 'g'))
+                return 1;
+        }
+        start += n;
+    } while (n == std::size(tags));
+
+    return 0;
 }
 
 void hbtransform(XftGlyphFontSpec* specs, Glyph const* glyphs, size_t len, int x, int y)
 {
     int             start = 0, length = 1, gstart = 0;
-    hb_codepoint_t* codepoints = (hb_codepoint_t*)calloc((unsigned int)len, sizeof(hb_codepoint_t));
+    hb_codepoint_t* codepoints;
+
+    /* glyphs of runs that are not shaped stay as they are */
+    hbcodepoints.assign(len, HB_CODEPOINT_INVALID);
+    codepoints = hbcodepoints.data();
 
     for (int idx = 1, specidx = 1; idx < len; idx++)
     {
@@ -109,7 +160,7 @@ void hbtransform(XftGlyphFontSpec* specs, Glyph const* glyphs, size_t len, int x
     {
         if (glyphs[i].mode & ATTR_WDUMMY)
             continue;
-        if (glyphs[i].mode & ATTR_BOXDRAW)
+        if ((glyphs[i].mode & ATTR_BOXDRAW) || codepoints[i] == HB_CODEPOINT_INVALID)
         {
             specidx++;
             continue;
@@ -120,36 +171,52 @@ void hbtransform(XftGlyphFontSpec* specs, Glyph const* glyphs, size_t len, int x
 
         specs[specidx++].glyph = codepoints[i];
     }
-
-    free(codepoints);
 }
 
 void hbtransformsegment(XftFont* xfont, Glyph const* string, hb_codepoint_t* codepoints, int start, int length)
 {
-    hb_font_t* font = hbfindfont(xfont);
-    if (font == NULL)
+    /* a single glyph or a font without ligatures has nothing to shape */
+    if (length < 2)
+        return;
+    HbFont* f = hbfindfont(xfont);
+    if (!f->liga)
         return;
 
-    Rune         rune;
-    ushort       mode   = USHRT_MAX;
-    hb_buffer_t* buffer = hb_buffer_create();
-    hb_buffer_set_direction(buffer, HB_DIRECTION_LTR);
+    Rune   rune;
+    ushort mode = USHRT_MAX;
 
-    /* Fill buffer with codepoints. */
+    /* The key is the font and the codepoints to shape. */
+    hbkey.resize(sizeof(xfont) / sizeof(char32_t));
+    memcpy(hbkey.data(), &xfont, sizeof(xfont));
     for (int i = start; i < (start + length); i++)
     {
         rune = string[i].u;
         mode = string[i].mode;
         if (mode & ATTR_WDUMMY)
             rune = 0x0020;
-        hb_buffer_add_codepoints(buffer, &rune, 1, 0, 1);
+        hbkey.push_back(rune);
+    }
+
+    auto it = hbshapecache.find(hbkey);
+    if (it != hbshapecache.end())
+    {
+        std::copy(it->second.begin(), it->second.end(), codepoints + start);
+        return;
     }
 
+    if (hbbuffer == NULL)
+        hbbuffer = hb_buffer_create();
+    hb_buffer_clear_contents(hbbuffer);
+    hb_buffer_set_direction(hbbuffer, HB_DIRECTION_LTR);
+
+    /* Fill buffer with codepoints. */
+    hb_buffer_add_codepoints(hbbuffer, (hb_codepoint_t const*)hbkey.data() + hbkey.size() - length, length, 0, length);
+
     /* Shape the segment. */
-    hb_shape(font, buffer, features, std::size(features));
+    hb_shape(f->font, hbbuffer, features, std::size(features));
 
     /* Get new glyph info. */
-    hb_glyph_info_t* info = hb_buffer_get_glyph_infos(buffer, NULL);
+    hb_glyph_info_t* info = hb_buffer_get_glyph_infos(hbbuffer, NULL);
 
     /* Write new codepoints. */
     for (int i = 0; i < length; i++)
@@ -158,6 +225,7 @@ void hbtransformsegment(XftFont* xfont, Glyph const* string, hb_codepoint_t* cod
         codepoints[start + i] = gid;
     }
 
-    /* Cleanup. */
-    hb_buffer_destroy(buffer);
-}
\ No newline at end of file
+    if (hbshapecache.size() >= HB_SHAPE_CACHE)
+        hbshapecache.clear();
+    hbshapecache.emplace(hbkey, std::vector<hb_codepoint_t>(codepoints + start, codepoints + start + length));
+}
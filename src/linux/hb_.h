@@ -9,4 +9,5 @@
 #include "con/con.hpp"
 
 void hbunloadfonts();
+void hbunloadfont(XftFont*);
 void hbtransform(XftGlyphFontSpec*, Glyph const*, size_t, int, int);
@@ -9,6 +9,8 @@
 #include <time.h>
 #include <unistd.h>
 #include <libgen.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
 #include <X11/Xatom.h>
 #include <X11/Xlib.h>
 #include <X11/cursorfont.h>
@@ -16,6 +18,7 @@
 #include <X11/Xft/Xft.h>
 #include <X11/XKBlib.h>
 #include <X11/Xcursor/Xcursor.h>
+#include <X11/extensions/XShm.h>
 #undef Glyph
 
 /* config.h for applying patches and the configuration. */
@@ -71,6 +74,7 @@ typedef struct
     Colormap       cmap;
     Window         win;
     Drawable       buf;
+    Region         damage;  /* parts of buf the window does not show yet */
     GlyphFontSpec* specbuf; /* font spec buffer used for rendering */
     Atom           xembed, wmdeletewin, netwmname, netwmpid, blur;
     struct
@@ -128,6 +132,12 @@ static int           xmakeglyphfontspecs(XftGlyphFontSpec*, Glyph const*, int, i
 static void          xdrawglyphfontspecs(XftGlyphFontSpec const*, Glyph, int, int, int);
 static void          xdrawglyph(Glyph, int, int);
 static void          xclear(int, int, int, int);
+static void          xdamage(int, int, int, int);
+static void          xshminit(void);
+static int           xshmerror(Display*, XErrorEvent*);
+static int           xshmalloc(size_t);
+static void          xputpixels(Drawable, GC, uint32_t const*, int, int, int);
+static void          xcolorrgb(XRenderColor const*, Color*);
 static int           xgeommasktogravity(int);
 static int           ximopen(Display*);
 static void          ximinstantiate(Display*, XPointer, XPointer);
@@ -211,6 +221,36 @@ Con               con;
 static int        tstki;                      /* title stack index */
 static char*      titlestack[TITLESTACKSIZE]; /* title stack */
 
+/*
+ * Colours allocated for RGB values: truecolor attributes, their reverse
+ * video and faint variants and underline colours. Two ways per slot.
+ */
+#define COLORCACHE 1024 /* slots, power of two */
+
+typedef struct
+{
+    uint64_t key; /* red, green, blue, alpha */
+    uint     used;
+    Color    col;
+} ColorCache;
+
+static ColorCache colorcache[COLORCACHE][2];
+static uint       colorcachetick = 0;
+
+/*
+ * MIT-SHM segment pixels are uploaded through, so they reach the server
+ * without going over the socket. There is one, grown as needed and reused.
+ */
+typedef struct
+{
+    XShmSegmentInfo info;
+    size_t          size; /* 0 while there is no segment */
+    int             ok;   /* the extension can be used */
+    int             busy; /* the server may still be reading it */
+} XShm;
+
+static XShm xshm;
+
 /* Font Ring Cache */
 enum
 {
@@ -220,17 +260,50 @@ enum
     FRC_ITALICBOLD
 };
 
+/*
+ * Fallback fonts, at most FRC_MAX of them. Each style looks for the
+ * first font covering a rune in its FcFontSort set, and opens every font
+ * of the set once, for all the runes it covers.
+ */
+#define FRC_MAX 16
+
 typedef struct
 {
     XftFont* font;
     int      flags;
-    Rune     unicodep;
+    int      idx; /* in the style's sorted set */
+    uint     used;
 } Fontcache;
 
+/*
+ * Glyph cache, the font and glyph index a rune was last drawn with for
+ * each of the FRC_* styles. Latin-1 is looked up directly, the rest goes
+ * through a small hash table that is emptied when it fills up.
+ */
+#define GLYPHCACHE 4096 /* power of two */
+
+typedef struct
+{
+    Rune     u;
+    int      flags;
+    XftFont* font;
+    FT_UInt  glyph;
+} GlyphCache;
+
+static GlyphCache gclatin[4][256];
+static GlyphCache gctable[GLYPHCACHE];
+static int        gclen = 0;
+
+static GlyphCache* glyphcache(Rune, int);
+static void        glyphcacheclear(void);
+static XftFont*    frcfind(Font*, int, Rune);
+static void        frctrim(void);
+
 /* Fontcache is an array now. A new font will be appended to the array. */
 static Fontcache*  frc             = NULL;
 static int         frclen          = 0;
 static int         frccap          = 0;
+static uint        frctick         = 0;
 static char const* usedfont        = NULL;
 static double      usedfontsize    = 0;
 static double      defaultfontsize = 0;
@@ -822,11 +895,46 @@ int xsetcolorname(int x, char const* name)
     return 0;
 }
 
+void xdamage(int x, int y, int w, int h)
+{
+    XRectangle r = {(short)x, (short)y, (unsigned short)w, (unsigned short)h};
+
+    XUnionRectWithRegion(&r, xw.damage, xw.damage);
+}
+
+/*
+ * The colour for an RGB value. Allocations are remembered, the two ways
+ * of a slot keep the most recently used ones.
+ */
+void xcolorrgb(XRenderColor const* c, Color* ncolor)
+{
+    ColorCache* e;
+    uint64_t    key = (uint64_t)c->red << 48 | (uint64_t)c->green << 32 | (uint64_t)c->blue << 16 | c->alpha;
+    int         s   = ((key * 0x9e3779b97f4a7c15) >> 32) & (COLORCACHE - 1);
+
+    e = colorcache[s][0].used >= colorcache[s][1].used ? &colorcache[s][0] : &colorcache[s][1];
+    if (e->used == 0 || e->key != key)
+    {
+        e = (e == &colorcache[s][0]) ? &colorcache[s][1] : &colorcache[s][0];
+        if (e->used == 0 || e->key != key)
+        {
+            /* take the least recently used way */
+            if (e->used)
+                XftColorFree(xw.dpy, xw.vis, xw.cmap, &e->col);
+            XftColorAllocValue(xw.dpy, xw.vis, xw.cmap, c, &e->col);
+            e->key = key;
+        }
+    }
+    e->used = ++colorcachetick;
+    *ncolor = e->col;
+}
+
 /*
  * Absolute coordinates.
  */
 void xclear(int x1, int y1, int x2, int y2)
 {
+    xdamage(x1, y1, x2 - x1, y2 - y1);
     XftDrawRect(xw.draw, &dc.col[IS_SET(MODE_REVERSE) ? defaultfg : defaultbg], x1, y1, x2 - x1, y2 - y1);
 }
 
@@ -1043,6 +1151,7 @@ void xunloadfonts(void)
     /* Free the loaded fonts in the font cache.  */
     while (frclen > 0)
         XftFontClose(xw.dpy, frc[--frclen].font);
+    glyphcacheclear();
 
     xunloadfont(&dc.font);
     xunloadfont(&dc.bfont);
@@ -1155,6 +1264,7 @@ void xinit(int cols, int rows)
     memset(&gcvalues, 0, sizeof(gcvalues));
     gcvalues.graphics_exposures = False;
     xw.buf                      = XCreatePixmap(xw.dpy, xw.win, win.w, win.h, xw.depth);
+    xw.damage                   = XCreateRegion();
     dc.gc                       = XCreateGC(xw.dpy, xw.buf, GCGraphicsExposures, &gcvalues);
     XSetForeground(xw.dpy, dc.gc, dc.col[defaultbg].pixel);
     XFillRectangle(xw.dpy, xw.buf, dc.gc, 0, 0, win.w, win.h);
@@ -1201,22 +1311,138 @@ void xinit(int cols, int rows)
         xsel.xtarget = XA_STRING;
 
     boxdraw_xinit(xw.dpy, xw.cmap, xw.draw, xw.vis);
+    xshminit();
 }
 
-int xmakeglyphfontspecs(XftGlyphFontSpec* specs, Glyph const* glyphs, int len, int x, int y)
+/*
+ * The cache entry for u in style flags. An entry without a font is new,
+ * the caller fills it in.
+ */
+GlyphCache* glyphcache(Rune u, int flags)
+{
+    GlyphCache* g;
+    uint        h, i;
+
+    if (u < LEN(gclatin[0]))
+        return &gclatin[flags][u];
+
+    h = ((u * 2654435761u) ^ flags) & (GLYPHCACHE - 1);
+    for (i = h; gctable[i].font; i = (i + 1) & (GLYPHCACHE - 1))
+    {
+        if (gctable[i].u == u && gctable[i].flags == flags)
+            return &gctable[i];
+    }
+
+    if (gclen >= GLYPHCACHE / 4 * 3)
+    {
+        memset(gctable, 0, sizeof(gctable));
+        gclen = 0;
+        i     = h;
+    }
+    gclen++;
+    g        = &gctable[i];
+    g->u     = u;
+    g->flags = flags;
+    return g;
+}
+
+/* fonts were closed, the pointers in the cache may be reused */
+void glyphcacheclear(void)
+{
+    memset(gclatin, 0, sizeof(gclatin));
+    memset(gctable, 0, sizeof(gctable));
+    gclen = 0;
+}
+
+/*
+ * The fallback font for u in style flags, NULL when no font of the set
+ * covers it.
+ */
+XftFont* frcfind(Font* font, int flags, Rune u)
 {
-    float      winx = win.hborderpx + x * win.cw, winy = win.vborderpx + y * win.ch, xp, yp;
-    ushort     mode, prevmode                          = USHRT_MAX;
-    Font*      font      = &dc.font;
-    int        frcflags  = FRC_NORMAL;
-    float      runewidth = win.cw;
-    Rune       rune;
-    FT_UInt    glyphidx;
     FcResult   fcres;
-    FcPattern* fcpattern,* fontpattern;
-    FcFontSet* fcsets[] = {NULL};
-    FcCharSet* fccharset;
-    int        i, f, numspecs = 0;
+    FcCharSet* charset;
+    FcPattern* pattern;
+    int        f, k;
+
+    if (!font->set)
+        font->set = FcFontSort(0, font->pattern, 1, 0, &fcres);
+    if (!font->set)
+        return NULL;
+
+    for (k = 0; k < font->set->nfont; k++)
+    {
+        if (FcPatternGetCharSet(font->set->fonts[k], FC_CHARSET, 0, &charset) == FcResultMatch && FcCharSetHasChar(charset, u))
+            break;
+    }
+    if (k == font->set->nfont)
+        return NULL;
+
+    for (f = 0; f < frclen; f++)
+    {
+        if (frc[f].flags == flags && frc[f].idx == k)
+        {
+            frc[f].used = ++frctick;
+            return frc[f].font;
+        }
+    }
+
+    /* Allocate memory for the new cache entry. */
+    if (frclen >= frccap)
+    {
+        frccap += 16;
+        frc = (Fontcache*)xrealloc(frc, frccap * sizeof(Fontcache));
+    }
+
+    pattern = FcFontRenderPrepare(0, font->pattern, font->set->fonts[k]);
+    if (!pattern || !(frc[frclen].font = XftFontOpenPattern(xw.dpy, pattern)))
+        die("XftFontOpenPattern failed seeking fallback font: %s\n", strerror(errno));
+    frc[frclen].flags = flags;
+    frc[frclen].idx   = k;
+    frc[frclen].used  = ++frctick;
+
+    return frc[frclen++].font;
+}
+
+/*
+ * Close the least recently used fallback fonts past FRC_MAX. This only
+ * runs between lines, the glyph specs of a line may use all of them.
+ */
+void frctrim(void)
+{
+    int f, lru;
+
+    if (frclen <= FRC_MAX)
+        return;
+
+    while (frclen > FRC_MAX)
+    {
+        for (lru = 0, f = 1; f < frclen; f++)
+        {
+            if (frc[f].used < frc[lru].used)
+                lru = f;
+        }
+        hbunloadfont(frc[lru].font);
+        XftFontClose(xw.dpy, frc[lru].font);
+        frc[lru] = frc[--frclen];
+    }
+    glyphcacheclear();
+}
+
+int xmakeglyphfontspecs(XftGlyphFontSpec* specs, Glyph const* glyphs, int len, int x, int y)
+{
+    float       winx = win.hborderpx + x * win.cw, winy = win.vborderpx + y * win.ch, xp, yp;
+    ushort      mode, prevmode                          = USHRT_MAX;
+    Font*       font      = &dc.font;
+    int         frcflags  = FRC_NORMAL;
+    float       runewidth = win.cw;
+    Rune        rune;
+    FT_UInt     glyphidx;
+    XftFont*    fallback;
+    GlyphCache* gc;
+    int         i, numspecs = 0;
+
+    frctrim();
 
     for (i = 0, xp = winx, yp = winy + font->ascent; i < len; ++i)
     {
@@ -1253,6 +1479,7 @@ int xmakeglyphfontspecs(XftGlyphFontSpec* specs, Glyph const* glyphs, int len, i
             yp = winy + font->ascent;
         }
 
+        gc = NULL;
         if (mode & ATTR_BOXDRAW)
         {
             /* minor shoehorning: boxdraw uses only this ushort */
@@ -1260,11 +1487,28 @@ int xmakeglyphfontspecs(XftGlyphFontSpec* specs, Glyph const* glyphs, int len, i
         }
         else
         {
+            gc = glyphcache(rune, frcflags);
+            if (gc->font)
+            {
+                specs[numspecs].font  = gc->font;
+                specs[numspecs].glyph = gc->glyph;
+                specs[numspecs].x     = (short)xp;
+                specs[numspecs].y     = (short)yp;
+                xp += runewidth;
+                numspecs++;
+                continue;
+            }
+
             /* Lookup character index with default font. */
             glyphidx = XftCharIndex(xw.dpy, font->match, rune);
         }
         if (glyphidx)
         {
+            if (gc)
+            {
+                gc->font  = font->match;
+                gc->glyph = glyphidx;
+            }
             specs[numspecs].font  = font->match;
             specs[numspecs].glyph = glyphidx;
             specs[numspecs].x     = (short)xp;
@@ -1274,69 +1518,18 @@ int xmakeglyphfontspecs(XftGlyphFontSpec* specs, Glyph const* glyphs, int len, i
             continue;
         }
 
-        /* Fallback on font cache, search the font cache for match. */
-        for (f = 0; f < frclen; f++)
-        {
-            glyphidx = XftCharIndex(xw.dpy, frc[f].font, rune);
-            /* Everything correct. */
-            if (glyphidx && frc[f].flags == frcflags)
-                break;
-            /* We got a default font for a not found glyph. */
-            if (!glyphidx && frc[f].flags == frcflags && frc[f].unicodep == rune)
-            {
-                break;
-            }
-        }
+        /* Fallback on the first font of the set that covers the rune. */
+        if ((fallback = frcfind(font, frcflags, rune)) != NULL)
+            glyphidx = XftCharIndex(xw.dpy, fallback, rune);
+        else
+            fallback = font->match;
 
-        /* Nothing was found. Use fontconfig to find matching font. */
-        if (f >= frclen)
+        if (gc)
         {
-            if (!font->set)
-                font->set = FcFontSort(0, font->pattern, 1, 0, &fcres);
-            fcsets[0] = font->set;
-
-            /*
-             * Nothing was found in the cache. Now use
-             * some dozen of Fontconfig calls to get the
-             * font for one single character.
-             *
-             * Xft and fontconfig are design failures.
-             */
-            fcpattern = FcPatternDuplicate(font->pattern);
-            fccharset = FcCharSetCreate();
-
-            FcCharSetAddChar(fccharset, rune);
-            FcPatternAddCharSet(fcpattern, FC_CHARSET, fccharset);
-            FcPatternAddBool(fcpattern, FC_SCALABLE, 1);
-
-            FcConfigSubstitute(0, fcpattern, FcMatchPattern);
-            FcDefaultSubstitute(fcpattern);
-
-            fontpattern = FcFontSetMatch(0, fcsets, 1, fcpattern, &fcres);
-
-            /* Allocate memory for the new cache entry. */
-            if (frclen >= frccap)
-            {
-                frccap += 16;
-                frc = (Fontcache*)xrealloc(frc, frccap * sizeof(Fontcache));
-            }
-
-            frc[frclen].font = XftFontOpenPattern(xw.dpy, fontpattern);
-            if (!frc[frclen].font)
-                die("XftFontOpenPattern failed seeking fallback font: %s\n", strerror(errno));
-            frc[frclen].flags    = frcflags;
-            frc[frclen].unicodep = rune;
-
-            glyphidx = XftCharIndex(xw.dpy, frc[frclen].font, rune);
-
-            f = frclen;
-            frclen++;
-
-            FcPatternDestroy(fcpattern);
-            FcCharSetDestroy(fccharset);
+            gc->font  = fallback;
+            gc->glyph = glyphidx;
         }
-
-        specs[numspecs].font  = frc[f].font;
+        specs[numspecs].font  = fallback;
         specs[numspecs].glyph = glyphidx;
         specs[numspecs].x     = (short)xp;
         specs[numspecs].y     = (short)yp;
@@ -1420,7 +1613,7 @@ void xdrawglyphfontspecs(XftGlyphFontSpec const* specs, Glyph base, int len, int
         colfg.red   = TRUERED(base.fg);
         colfg.green = TRUEGREEN(base.fg);
         colfg.blue  = TRUEBLUE(base.fg);
-        XftColorAllocValue(xw.dpy, xw.vis, xw.cmap, &colfg, &truefg);
+        xcolorrgb(&colfg, &truefg);
         fg = &truefg;
     }
     else
@@ -1434,7 +1627,7 @@ void xdrawglyphfontspecs(XftGlyphFontSpec const* specs, Glyph base, int len, int
         colbg.green = TRUEGREEN(base.bg);
         colbg.red   = TRUERED(base.bg);
         colbg.blue  = TRUEBLUE(base.bg);
-        XftColorAllocValue(xw.dpy, xw.vis, xw.cmap, &colbg, &truebg);
+        xcolorrgb(&colbg, &truebg);
         bg = &truebg;
     }
     else
@@ -1458,7 +1651,7 @@ void xdrawglyphfontspecs(XftGlyphFontSpec const* specs, Glyph base, int len, int
             colfg.green = ~fg->color.green;
             colfg.blue  = ~fg->color.blue;
             colfg.alpha = fg->color.alpha;
-            XftColorAllocValue(xw.dpy, xw.vis, xw.cmap, &colfg, &revfg);
+            xcolorrgb(&colfg, &revfg);
             fg = &revfg;
         }
 
@@ -1472,7 +1665,7 @@ void xdrawglyphfontspecs(XftGlyphFontSpec const* specs, Glyph base, int len, int
             colbg.green = ~bg->color.green;
             colbg.blue  = ~bg->color.blue;
             colbg.alpha = bg->color.alpha;
-            XftColorAllocValue(xw.dpy, xw.vis, xw.cmap, &colbg, &revbg);
+            xcolorrgb(&colbg, &revbg);
             bg = &revbg;
         }
     }
@@ -1483,7 +1676,7 @@ void xdrawglyphfontspecs(XftGlyphFontSpec const* specs, Glyph base, int len, int
         colfg.green = fg->color.green / 2;
         colfg.blue  = fg->color.blue / 2;
         colfg.alpha = fg->color.alpha;
-        XftColorAllocValue(xw.dpy, xw.vis, xw.cmap, &colfg, &revfg);
+        xcolorrgb(&colfg, &revfg);
         fg = &revfg;
     }
 
@@ -1516,6 +1709,7 @@ void xdrawglyphfontspecs(XftGlyphFontSpec const* specs, Glyph base, int len, int
 
     /* Clean up the region we want to draw to. */
     XftDrawRect(xw.draw, bg, winx, winy, width, win.ch);
+    xdamage(winx, winy, width, win.ch);
 
     /* Set the clip region because Xft is sometimes dirty. */
     r.x      = 0;
@@ -1540,24 +1734,26 @@ void xdrawglyphfontspecs(XftGlyphFontSpec const* specs, Glyph base, int len, int
         // Underline Color
         int const widthThreshold = 28;                            // +1 width every widthThreshold px of font
         int       wlw            = (win.ch / widthThreshold) + 1; // Wave Line Width
-        int       linecolor;
-        if ((base.ucolor[0] >= 0) && !(base.mode & ATTR_BLINK && win.mode & MODE_BLINK) && !(base.mode & ATTR_INVISIBLE))
+        int               linecolor;
+        GlyphExtra const& extra = con.term.extras[base.extra];
+        if ((extra.ucolor[0] >= 0) && !(base.mode & ATTR_BLINK && win.mode & MODE_BLINK) && !(base.mode & ATTR_INVISIBLE))
         {
             // Special color for underline
             // Index
-            if (base.ucolor[1] < 0)
+            if (extra.ucolor[1] < 0)
             {
-                linecolor = dc.col[base.ucolor[0]].pixel;
+                linecolor = dc.col[extra.ucolor[0]].pixel;
             }
             // RGB
             else
             {
-                XColor lcolor;
-                lcolor.red   = base.ucolor[0] * 257;
-                lcolor.green = base.ucolor[1] * 257;
-                lcolor.blue  = base.ucolor[2] * 257;
-                lcolor.flags = DoRed | DoGreen | DoBlue;
-                XAllocColor(xw.dpy, xw.cmap, &lcolor);
+                XRenderColor ucolor;
+                Color        lcolor;
+                ucolor.red   = extra.ucolor[0] * 257;
+                ucolor.green = extra.ucolor[1] * 257;
+                ucolor.blue  = extra.ucolor[2] * 257;
+                ucolor.alpha = 0xffff;
+                xcolorrgb(&ucolor, &lcolor);
                 linecolor = lcolor.pixel;
             }
         }
@@ -1572,12 +1768,12 @@ void xdrawglyphfontspecs(XftGlyphFontSpec const* specs, Glyph base, int len, int
         GC ugc = XCreateGC(xw.dpy, XftDrawDrawable(xw.draw), GCForeground | GCLineWidth | GCLineStyle | GCCapStyle, &ugcv);
 
         // Underline Style
-        if (base.ustyle != 3)
+        if (extra.ustyle != 3)
         {
             // XftDrawRect(xw.draw, fg, winx, winy + dc.font.ascent + 1, width, 1);
             XFillRectangle(xw.dpy, XftDrawDrawable(xw.draw), ugc, winx, winy + dc.font.ascent + 1, width, wlw);
         }
-        else if (base.ustyle == 3)
+        else if (extra.ustyle == 3)
         {
             int ww = win.cw;                        // width;
             int wh = dc.font.descent - wlw / 2 - 1; // r.height/7;
@@ -1893,6 +2089,7 @@ void xdrawcursor(int cx, int cy, Glyph g, int ox, int oy, Glyph og, Line line, i
 
     if (IS_SET(MODE_HIDE))
         return;
+    xdamage(win.hborderpx + cx * win.cw, win.vborderpx + cy * win.ch, (g.mode & ATTR_WIDE) ? 2 * win.cw : win.cw, win.ch);
 
     /*
      * Select the right color for the right mode.
@@ -1937,7 +2134,7 @@ void xdrawcursor(int cx, int cy, Glyph g, int ox, int oy, Glyph og, Line line, i
             colbg.red   = TRUERED(g.bg);
             colbg.green = TRUEGREEN(g.bg);
             colbg.blue  = TRUEBLUE(g.bg);
-            XftColorAllocValue(xw.dpy, xw.vis, xw.cmap, &colbg, &drawcol);
+            xcolorrgb(&colbg, &drawcol);
         }
         else
         {
@@ -2030,110 +2227,183 @@ void xpushtitle(void)
     tstki              = tstkin;
 }
 
+/* xw.buf always holds the whole window, frames only draw what changed */
 int xstartdraw(void)
 {
-    if (IS_SET(MODE_VISIBLE))
-        XCopyArea(xw.dpy, xw.win, xw.buf, dc.gc, 0, 0, win.w, win.h, 0, 0);
     return IS_SET(MODE_VISIBLE);
 }
 
-void xdrawsixel(size_t col, size_t row)
+/*
+ * Draw the images in view over the text. Only those are looked at, found
+ * by the row of their top edge. An image is uploaded when first shown and
+ * keeps a GC clipped to the part of it on screen, which is only set again
+ * when that part changes.
+ */
+void xdrawsixel(size_t row, size_t col)
 {
-    int n = 0;
-    int nlimit = 256;
+    ImageMap&          images = con.term.images;
+    ImageMap::iterator it;
+    unsigned           tick  = ++con.term.imgtick;
+    long long          first = con.term.rowbase - con.term.scr, top, rows;
+    int                alt   = (con.term.mode & MODE_ALTSCREEN) != 0;
+    std::array<int, 4> clip;
+    XRectangle         r;
 
-    for (auto& image : con.term.images)
+    it = images.lower_bound(first - DIVCEIL((long long)con.term.imgh, win.ch) + 1);
+    for (; it != images.end() && it->first < first + (long long)row; ++it)
     {
+        Image& image = it->second;
+
+        top  = it->first - first;
+        rows = DIVCEIL((long long)image.height, win.ch);
+        if (image.alt != alt || top + rows <= 0 || image.x >= col)
+            continue;
+
         if (image.drawable == nullptr)
         {
             auto depth    = DefaultDepth(xw.dpy, xw.scr);
             auto drawable = XCreatePixmap(xw.dpy, xw.win, image.width, image.height, depth);
 
-            XImage ximage           = {0};
-            ximage.format           = ZPixmap,
-            ximage.data             = (char*)image.data.data();
-            ximage.width            = image.width,
-            ximage.height           = image.height,
-            ximage.xoffset          = 0,
-            ximage.byte_order       = LSBFirst,
-            ximage.bitmap_bit_order = MSBFirst,
-            ximage.bits_per_pixel   = 32,
-            ximage.bytes_per_line   = image.width * 4,
-            ximage.bitmap_unit      = 32,
-            ximage.bitmap_pad       = 32,
-            ximage.depth            = depth;
-
             XGCValues gcvalues = {0};
-            auto      gc       = XCreateGC(xw.dpy, drawable, 0, &gcvalues);
-            XPutImage(xw.dpy, drawable, gc, &ximage, 0, 0, 0, 0, image.width, image.height);
-            XFlush(xw.dpy);
-            XFreeGC(xw.dpy, gc);
+            auto      gc       = XCreateGC(xw.dpy, xw.buf, 0, &gcvalues);
+            xputpixels(drawable, gc, image.data.data(), image.width, image.height, depth);
             image.drawable = (void*)drawable;
+            image.gc       = (void*)gc;
+            image.clip     = {};
+            std::vector<uint32_t>().swap(image.data);
         }
+        image.used = tick;
 
-        std::vector<XRectangle> rects;
-
-        for (auto y = image.y; y < (image.y + (image.height + win.ch - 1) / win.ch) && y < row; y++)
+        clip[0] = win.hborderpx + image.x * win.cw;
+        clip[1] = win.vborderpx + MAX(top, 0LL) * win.ch;
+        clip[2] = MIN(image.x + DIVCEIL(image.width, (size_t)win.cw), col) * win.cw + win.hborderpx - clip[0];
+        clip[3] = MIN(top + rows, (long long)row) * win.ch + win.vborderpx - clip[1];
+        if (clip != image.clip)
         {
-            if (y >= 0)
-            {
-                for (auto x = image.x; x < (image.x + (image.width + win.cw - 1) / win.cw) && x < col; x++)
-                {
-                    // if (line[y][x].mode & ATTR_SIXEL)
-                    {
-                        if (!rects.empty())
-                        {
-                            if (rects[rects.size() - 1].x + rects[rects.size() - 1].width == borderpx + x * win.cw && rects[rects.size() - 1].y == borderpx + y * win.ch)
-                            {
-                                rects[rects.size() - 1].width += win.cw;
-                            }
-                            else
-                            {
-                                XRectangle rect;
-                                rect.x = borderpx + x * win.cw;
-                                rect.y = borderpx + y * win.ch;
-                                rect.width = win.cw;
-                                rect.height = win.ch;
-                                rects.push_back(rect);
-                            }
-                        }
-                        else
-                        {
-                            XRectangle rect;
-                            rect.x = borderpx + x * win.cw;
-                            rect.y = borderpx + y * win.ch;
-                            rect.width = win.cw;
-                            rect.height = win.ch;
-                            rects.push_back(rect);
-                        }
-                    }
-                }
-            }
-            if (rects.size() > 2 && rects[rects.size() - 2].x == rects[rects.size() - 1].x && rects[rects.size() - 2].width == rects[rects.size() - 1].width)
-            {
-                if (rects[rects.size() - 2].y + rects[rects.size() - 2].height == rects[rects.size() - 1].y)
-                {
-                    rects[rects.size() - 2].height += win.ch;
-                    n--;
-                }
-            }
+            r = {(short)clip[0], (short)clip[1], (unsigned short)clip[2], (unsigned short)clip[3]};
+            XSetClipRectangles(xw.dpy, (GC)image.gc, 0, 0, &r, 1, YXSorted);
+            image.clip = clip;
         }
 
-        if (con.term.top <= image.y && image.y < con.term.bot)
-        {
-            XGCValues gcvalues = {0};
-            auto      gc       = XCreateGC(xw.dpy, xw.win, 0, &gcvalues);
-            if (!rects.empty())
-                XSetClipRectangles(xw.dpy, gc, 0, 0, rects.data(), rects.size(), YXSorted);
-
-            auto v = win.hborderpx + image.x * win.cw;
-            auto h = win.vborderpx + image.y * win.ch;
-            XCopyArea(xw.dpy, (Drawable)image.drawable, xw.buf, gc, 0, 0, image.width, image.height, v, h);
-            XFreeGC(xw.dpy, gc);
-        }
+        XCopyArea(xw.dpy, (Drawable)image.drawable, xw.buf, (GC)image.gc, 0, 0, image.width, image.height, clip[0], win.vborderpx + top * win.ch);
+        xdamage(clip[0], clip[1], clip[2], clip[3]);
     }
 }
 
+/*
+ * MIT-SHM needs the server to map our segment, so only a local connection
+ * will do. The pixels are handed over as they are, in the server's order.
+ */
+void xshminit(void)
+{
+    char const* name = DisplayString(xw.dpy);
+
+    xshm.ok = XShmQueryExtension(xw.dpy) && ImageByteOrder(xw.dpy) == LSBFirst && name && (name[0] == ':' || name[0] == '/' || !strncmp(name, "unix:", 5));
+}
+
+/* the attach can still fail on the server's side, shared memory is off then */
+int xshmerror(Display* dpy, XErrorEvent* ev)
+{
+    xshm.ok = 0;
+    return 0;
+}
+
+/* make sure the segment holds size bytes, 0 if MIT-SHM can't be used */
+int xshmalloc(size_t size)
+{
+    XErrorHandler handler;
+
+    if (!xshm.ok)
+        return 0;
+    if (xshm.busy)
+    {
+        /* the last put has to be done with the segment before it is reused */
+        XSync(xw.dpy, False);
+        xshm.busy = 0;
+    }
+    if (size <= xshm.size)
+        return 1;
+
+    if (xshm.size)
+    {
+        XShmDetach(xw.dpy, &xshm.info);
+        XSync(xw.dpy, False);
+        shmdt(xshm.info.shmaddr);
+        xshm.size = 0;
+    }
+
+    size = MAX(size, (size_t)1 << 20);
+    if ((xshm.info.shmid = shmget(IPC_PRIVATE, size, IPC_CREAT | 0600)) < 0)
+        return xshm.ok = 0;
+    xshm.info.shmaddr = (char*)shmat(xshm.info.shmid, NULL, 0);
+    if (xshm.info.shmaddr == (char*)-1)
+    {
+        shmctl(xshm.info.shmid, IPC_RMID, NULL);
+        return xshm.ok = 0;
+    }
+    xshm.info.readOnly = True;
+
+    handler = XSetErrorHandler(xshmerror);
+    XShmAttach(xw.dpy, &xshm.info);
+    XSync(xw.dpy, False);
+    XSetErrorHandler(handler);
+
+    /* gone once both sides have let go of it */
+    shmctl(xshm.info.shmid, IPC_RMID, NULL);
+    if (!xshm.ok)
+    {
+        shmdt(xshm.info.shmaddr);
+        return 0;
+    }
+    xshm.size = size;
+    return 1;
+}
+
+/*
+ * Put w x h pixels of 0xRRGGBB into drawable. They are copied into the
+ * shared segment when there is one, else sent over the socket. Either
+ * way the caller may free the pixels right after.
+ */
+void xputpixels(Drawable drawable, GC gc, uint32_t const* pixels, int w, int h, int depth)
+{
+    size_t size = (size_t)w * h * 4;
+    XImage ximage;
+
+    memset(&ximage, 0, sizeof(ximage));
+    ximage.format           = ZPixmap;
+    ximage.width            = w;
+    ximage.height           = h;
+    ximage.xoffset          = 0;
+    ximage.byte_order       = LSBFirst;
+    ximage.bitmap_bit_order = MSBFirst;
+    ximage.bits_per_pixel   = 32;
+    ximage.bytes_per_line   = w * 4;
+    ximage.bitmap_unit      = 32;
+    ximage.bitmap_pad       = 32;
+    ximage.depth            = depth;
+
+    if (xshmalloc(size))
+    {
+        memcpy(xshm.info.shmaddr, pixels, size);
+        ximage.data   = xshm.info.shmaddr;
+        ximage.obdata = (char*)&xshm.info;
+        XShmPutImage(xw.dpy, drawable, gc, &ximage, 0, 0, 0, 0, w, h, False);
+        xshm.busy = 1;
+        return;
+    }
+
+    ximage.data = (char*)pixels;
+    XPutImage(xw.dpy, drawable, gc, &ximage, 0, 0, 0, 0, w, h);
+}
+
+void xfreesixel(Image& image)
+{
+    if (image.drawable)
+        XFreePixmap(xw.dpy, (Pixmap)image.drawable);
+    if (image.gc)
+        XFreeGC(xw.dpy, (GC)image.gc);
+}
+
 void xdrawline(Line line, int x1, int y1, int x2)
 {
     int               i, x, ox, numspecs;
@@ -2144,7 +2414,7 @@ void xdrawline(Line line, int x1, int y1, int x2)
     i = ox = 0;
     for (x = x1; x < x2 && i < numspecs; x++)
     {
-        auto& new_ = line[x];
+        Glyph new_ = line[x];
         if (new_.mode == ATTR_WDUMMY)
             continue;
 
@@ -2168,9 +2438,29 @@ void xdrawline(Line line, int x1, int y1, int x2)
         xdrawglyphfontspecs(specs, base, i, ox, y1);
 }
 
+/* move rows top to bot of the back buffer up by n rows, down if negative */
+void xscroll(int top, int bot, int n)
+{
+    int src = top + MAX(n, 0), dst = top + MAX(-n, 0), h = bot - top + 1 - abs(n);
+
+    XCopyArea(xw.dpy, xw.buf, xw.buf, dc.gc, win.hborderpx, win.vborderpx + src * win.ch, win.tw, h * win.ch, win.hborderpx, win.vborderpx + dst * win.ch);
+    xdamage(win.hborderpx, win.vborderpx + dst * win.ch, win.tw, h * win.ch);
+}
+
+/* show what was drawn this frame, and only that */
 void xfinishdraw(void)
 {
-    XCopyArea(xw.dpy, xw.buf, xw.win, dc.gc, 0, 0, win.w, win.h, 0, 0);
+    XRectangle r;
+
+    if (!XEmptyRegion(xw.damage))
+    {
+        XClipBox(xw.damage, &r);
+        XSetRegion(xw.dpy, dc.gc, xw.damage);
+        XCopyArea(xw.dpy, xw.buf, xw.win, dc.gc, r.x, r.y, r.width, r.height, r.x, r.y);
+        XSetClipMask(xw.dpy, dc.gc, 0);
+        XDestroyRegion(xw.damage);
+        xw.damage = XCreateRegion();
+    }
     XSetForeground(xw.dpy, dc.gc, dc.col[IS_SET(MODE_REVERSE) ? defaultfg : defaultbg].pixel);
 }
 
@@ -2187,7 +2477,11 @@ void xximspot(int x, int y)
 
 void expose(XEvent* ev)
 {
-    redraw();
+    XExposeEvent* e = &ev->xexpose;
+
+    /* the back buffer is up to date, it only has to be shown again */
+    xdamage(e->x, e->y, e->width, e->height);
+    draw();
 }
 
 void visibility(XEvent* ev)
@@ -2536,11 +2830,11 @@ void run(void)
 void usage(void)
 {
     die("usage: %s [-aiv] [-c class] [-f font] [-g geometry]"
-        " [-n name] [-o file]\n"
+        " [-H lines] [-M megabytes] [-n name] [-o file]\n"
         "          [-T title] [-t title] [-w windowid]"
         " [[-e] command [args ...]]\n"
         "       %s [-aiv] [-c class] [-f font] [-g geometry]"
-        " [-n name] [-o file]\n"
+        " [-H lines] [-M megabytes] [-n name] [-o file]\n"
         "          [-T title] [-t title] [-w windowid] -l line"
         " [stty_args ...]\n",
         argv0, argv0);
@@ -2573,9 +2867,15 @@ int main(int argc, char* argv[])
     case 'g':
         xw.gm = XParseGeometry(EARGF(usage()), &xw.l, &xw.t, &cols, &rows);
         break;
+    case 'H':
+        histsize = atoi(EARGF(usage()));
+        break;
     case 'i':
         xw.isfixed = 1;
         break;
+    case 'M':
+        histmem = strtoul(EARGF(usage()), NULL, 10);
+        break;
     case 'o':
         opt_io = EARGF(usage());
         break;
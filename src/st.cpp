@@ -3,7 +3,9 @@
 #include "win.h"
 #include "con/con.hpp"
 
-static void drawregion(int, int, int, int);
+static void     drawregion(int, int, int, int);
+static uint64_t rowhash(Line, int, int);
+static void     drawscrolls(void);
 
 extern Con        con;
 extern TermWindow win;
@@ -51,6 +53,7 @@ void kscrolldown(Arg const& a)
     {
         con.term.scr -= n;
         con.selscroll(0, -n);
+        con.tsetscrolled(0, con.term.row - 1, n);
         con.tfulldirt();
     }
 }
@@ -62,10 +65,15 @@ void kscrollup(Arg const& a)
     if (n < 0)
         n = con.term.row + n;
 
-    if (con.term.scr <= HISTSIZE - n)
+    /* history is indexed lazily, only as far as it gets scrolled back */
+    if (n > con.term.hist.rows(con.term.scr + n) - con.term.scr)
+        n = con.term.hist.len - con.term.scr;
+
+    if (n > 0)
     {
         con.term.scr += n;
         con.selscroll(0, n);
+        con.tsetscrolled(0, con.term.row - 1, -n);
         con.tfulldirt();
     }
 }
@@ -76,20 +84,114 @@ void resettitle(void)
 }
 
 #undef TLINE
-#define TLINE(y) ((y) < con.term.scr ? con.term.hist[((y) + con.term.histi - con.term.scr + HISTSIZE + 1) % HISTSIZE] : con.term.line[(y)-con.term.scr])
+#define TLINE(y) ((y) < con.term.scr ? con.term.hist[con.term.hist.len - con.term.scr + (y)] : con.term.line[(y)-con.term.scr])
+
+/*
+ * What row y shows: its cells and the columns of it that are selected.
+ * Never 0, that is left for rows whose contents are unknown.
+ */
+uint64_t rowhash(Line line, int y, int col)
+{
+    Selection const& sel = con.sel;
+    uint64_t         h   = 0xcbf29ce484222325, w[2];
+    int              x, a, b;
+
+    for (x = 0; x < col; x++)
+    {
+        memcpy(w, &line[x], sizeof(w));
+        h = (h ^ w[0]) * 0x9e3779b97f4a7c15;
+        h = (h ^ (h >> 29) ^ w[1]) * 0x9e3779b97f4a7c15;
+        h ^= h >> 32;
+    }
 
+    if (sel.mode != SEL_EMPTY && sel.ob.x != -1 && sel.alt == ((con.term.mode & MODE_ALTSCREEN) != 0) && BETWEEN(y, sel.nb.y, sel.ne.y))
+    {
+        a = (sel.type == SEL_RECTANGULAR || y == sel.nb.y) ? sel.nb.x : 0;
+        b = (sel.type == SEL_RECTANGULAR || y == sel.ne.y) ? sel.ne.x : col;
+        h = (h ^ ((uint64_t)a << 32 | (uint32_t)b)) * 0x9e3779b97f4a7c15;
+    }
+
+    return h | 1;
+}
+
+/*
+ * Redraw the changed columns of each row. The span is widened to the
+ * words around it, a ligature can change with any character of the word
+ * it is in, and to whole wide glyphs. Rows that look the same as when
+ * they were last drawn are left alone, whatever marked them dirty.
+ */
 void drawregion(int x1, int y1, int x2, int y2)
 {
-    int y;
+    Line     line;
+    uint64_t h;
+    int      y, b, e;
 
     for (y = y1; y < y2; y++)
     {
-        if (!con.term.dirty[y])
+        DirtySpan& d = con.term.dirty[y];
+
+        b = MAX(d.x1, x1);
+        e = MIN(d.x2 + 1, x2);
+        d = {};
+        if (b >= e)
             continue;
 
-        con.term.dirty[y] = 0;
-        xdrawline(TLINE(y), x1, y, x2);
+        line = TLINE(y);
+        h    = rowhash(line, y, con.term.col);
+        if (h == con.term.drawn[y])
+            continue;
+        con.term.drawn[y] = h;
+        if (line[b].mode & ATTR_WDUMMY)
+            b--;
+        while (b > x1 && line[b - 1].u != ' ' && !ATTRCMP(line[b - 1], line[b]))
+            b--;
+        if (e < x2 && (line[e].mode & ATTR_WDUMMY))
+            e++;
+        while (e < x2 && line[e].u != ' ' && !ATTRCMP(line[e - 1], line[e]))
+            e++;
+
+        xdrawline(line, b, y, e);
+    }
+}
+
+/*
+ * Move what the window shows along with the rows that were scrolled, the
+ * hashes of the rows go with it. Rows that are still dirty after that
+ * are drawn by drawregion as usual.
+ */
+void drawscrolls(void)
+{
+    auto& drawn = con.term.drawn;
+    int   h;
+
+    if (con.term.scrolls.empty())
+        return;
+
+    /* the cursor is moved with the rows, the row it ends up in is drawn again */
+    drawn[con.term.ocy] = 0;
+
+    for (auto& s : con.term.scrolls)
+    {
+        h = s.bot - s.top + 1;
+        if (abs(s.n) >= h)
+        {
+            std::fill(&drawn[s.top], &drawn[s.bot] + 1, 0);
+            continue;
+        }
+
+        xscroll(s.top, s.bot, s.n);
+        if (s.n > 0)
+        {
+            std::copy(&drawn[s.top + s.n], &drawn[s.bot] + 1, &drawn[s.top]);
+            std::fill(&drawn[s.bot - s.n + 1], &drawn[s.bot] + 1, 0);
+        }
+        else
+        {
+            std::copy_backward(&drawn[s.top], &drawn[s.bot + s.n] + 1, &drawn[s.bot] + 1);
+            std::fill(&drawn[s.top], &drawn[s.top - s.n], 0);
+        }
     }
+    con.term.scrolls.clear();
 }
 
 void draw(void)
@@ -107,6 +209,7 @@ void draw(void)
     if (con.term.line[con.term.c.y][cx].mode & ATTR_WDUMMY)
         cx--;
 
+    drawscrolls();
     drawregion(0, 0, con.term.col, con.term.row);
     if (con.term.scr == 0)
         xdrawcursor(
@@ -122,6 +225,9 @@ void draw(void)
 
 void redraw(void)
 {
+    /* the window has to be drawn again, whatever it showed */
+    std::fill(con.term.drawn.begin(), con.term.drawn.end(), 0);
+    con.term.scrolls.clear();
     con.tfulldirt();
     draw();
 }
\ No newline at end of file
@@ -0,0 +1,93 @@
+#include "unicode.hpp"
+#include "unicode_data.hpp"
+
+#include <utility>
+
+constexpr auto NBLOCKS = UNI_MAX / UNI_BLOCK;
+
+using UniBlock = std::array<uint8_t, UNI_BLOCK>;
+
+struct UniBuild
+{
+    std::array<uint8_t, NBLOCKS> stage1 = {};
+    std::array<UniBlock, 256>    stage2 = {}; // stage1 holds bytes
+    int                          n      = 0;
+};
+
+/*
+ * Fill in the blocks from the ranges and keep the distinct ones. Most
+ * blocks hold a single value, those are told apart by that value alone.
+ * The others are compared by a hash first, it has to be cheap enough to
+ * run within the compiler's constexpr limits.
+ */
+constexpr UniBuild unibuild(void)
+{
+    UniBuild                  t;
+    UniBlock                  b;
+    std::array<int, 256>      uniform;
+    std::array<uint32_t, 256> hash = {};
+    size_t                    r = 0, k;
+    uint32_t                  base, end, lo, hi, c, h;
+    int                       i, j;
+
+    uniform.fill(-1);
+    for (i = 0; i < NBLOCKS; i++)
+    {
+        base = i * UNI_BLOCK;
+        end  = base + UNI_BLOCK - 1;
+        while (r < std::size(uniranges) && uniranges[r].last < base)
+            r++;
+
+        if (r == std::size(uniranges) || uniranges[r].first > end || (uniranges[r].first <= base && uniranges[r].last >= end))
+        {
+            c = (r == std::size(uniranges) || uniranges[r].first > end) ? 1 : uniranges[r].prop;
+            if (uniform[c] < 0)
+            {
+                t.stage2[t.n].fill(c);
+                uniform[c] = t.n++;
+            }
+            t.stage1[i] = uniform[c];
+            continue;
+        }
+
+        b.fill(1);
+        for (k = r; k < std::size(uniranges) && uniranges[k].first <= end; k++)
+        {
+            lo = uniranges[k].first > base ? uniranges[k].first : base;
+            hi = uniranges[k].last < end ? uniranges[k].last : end;
+            for (c = lo; c <= hi; c++)
+                b[c - base] = uniranges[k].prop;
+        }
+        for (h = 2166136261u, c = 0; c < UNI_BLOCK; c++)
+            h = (h ^ b[c]) * 16777619u;
+
+        for (j = 0; j < t.n && (hash[j] != h || t.stage2[j] != b); j++)
+            ;
+        if (j == t.n)
+        {
+            hash[t.n]     = h;
+            t.stage2[t.n] = b;
+            t.n++;
+        }
+        t.stage1[i] = j;
+    }
+    return t;
+}
+
+constexpr UniBuild unibuilt = unibuild();
+
+static_assert(unibuilt.n < 256);
+
+template<size_t... I>
+constexpr auto unistage2(std::index_sequence<I...>)
+{
+    return std::array<UniBlock, sizeof...(I)>{unibuilt.stage2[I]...};
+}
+
+/* only the distinct blocks end up in the binary */
+static constexpr auto stage2 = unistage2(std::make_index_sequence<unibuilt.n>());
+
+UniTables const unitables = {
+    .stage1 = unibuilt.stage1,
+    .stage2 = stage2.data(),
+};
@@ -0,0 +1,40 @@
+#pragma once
+#include "utf8.hpp"
+
+#include <array>
+
+// What the terminal needs to know about a code point, in one byte: the
+// cells it takes and a few flags.
+enum unicode_property
+{
+    UNI_WIDTH     = 3,      // mask, 0 to 2 cells
+    UNI_COMBINING = 1 << 2, // Mn, Me: goes on top of the previous character
+    UNI_EMOJI     = 1 << 3, // Emoji_Presentation
+    UNI_BOXDRAW   = 1 << 4, // U+2500 - U+259F
+    UNI_BRAILLE   = 1 << 5, // U+2800 - U+28FF
+    UNI_CONTROL   = 1 << 6, // Cc
+};
+
+constexpr auto UNI_BLOCK = 256;
+constexpr auto UNI_MAX   = 0x110000;
+
+// Two stage lookup, code points are split into blocks of UNI_BLOCK and
+// stage1 maps each block to one of the distinct blocks in stage2. Both
+// are built from the ranges in unicode_data.hpp at compile time.
+struct UniTables
+{
+    std::array<uint8_t, UNI_MAX / UNI_BLOCK> stage1;
+    std::array<uint8_t, UNI_BLOCK> const*    stage2;
+};
+
+extern UniTables const unitables;
+
+inline uint8_t uniprop(Rune u)
+{
+    return u < UNI_MAX ? unitables.stage2[unitables.stage1[u / UNI_BLOCK]][u % UNI_BLOCK] : 1;
+}
+
+inline int uniwidth(Rune u)
+{
+    return uniprop(u) & UNI_WIDTH;
+}
@@ -2,6 +2,11 @@
 #include "support.hpp"
 #include <array>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define ASCIIRUN_X86
+#endif
+
 static std::array<uchar, UTF_SIZ + 1> utfbyte = {0x80, 0, 0xC0, 0xE0, 0xF0};
 static std::array<uchar, UTF_SIZ + 1> utfmask = {0xC0, 0x80, 0xE0, 0xF0, 0xF8};
 static std::array<Rune, UTF_SIZ + 1>  utfmin  = {0, 0, 0x80, 0x800, 0x10000};
@@ -15,6 +20,28 @@ size_t utf8decode(char const* c, Rune& u, size_t clen)
     u = UTF_INVALID;
     if (!clen)
         return 0;
+
+    /* well formed sequences of up to three bytes, most text is made of */
+    uchar const* s = (uchar const*)c;
+    if ((s[0] & 0xE0) == 0xC0 && clen >= 2 && (s[1] & 0xC0) == 0x80)
+    {
+        udecoded = (s[0] & 0x1F) << 6 | (s[1] & 0x3F);
+        if (udecoded >= 0x80)
+        {
+            u = udecoded;
+            return 2;
+        }
+    }
+    else if ((s[0] & 0xF0) == 0xE0 && clen >= 3 && (s[1] & 0xC0) == 0x80 && (s[2] & 0xC0) == 0x80)
+    {
+        udecoded = (s[0] & 0x0F) << 12 | (s[1] & 0x3F) << 6 | (s[2] & 0x3F);
+        if (udecoded >= 0x800 && !BETWEEN(udecoded, 0xD800, 0xDFFF))
+        {
+            u = udecoded;
+            return 3;
+        }
+    }
+
     udecoded = utf8decodebyte(c[0], &len);
     if (!BETWEEN(len, 1, UTF_SIZ))
         return 1;
@@ -71,4 +98,63 @@ size_t utf8validate(Rune& u, size_t i)
         u = UTF_INVALID;
     for (i = 1; u > utfmax[i]; ++i) {}
     return i;
-}
\ No newline at end of file
+}
+
+#if defined(ASCIIRUN_X86)
+/*
+ * Bytes in 0x20 - 0x7e are the ones greater than 0x1f and less than 0x7f
+ * when compared as signed chars, which also rules out anything >= 0x80.
+ */
+__attribute__((target("avx2"))) static size_t asciirun_avx2(char const* c, size_t clen)
+{
+    __m256i lo = _mm256_set1_epi8(0x1f), hi = _mm256_set1_epi8(0x7f);
+    size_t  i;
+
+    for (i = 0; i + 32 <= clen; i += 32)
+    {
+        __m256i  v    = _mm256_loadu_si256((__m256i const*)(c + i));
+        __m256i  ok   = _mm256_and_si256(_mm256_cmpgt_epi8(v, lo), _mm256_cmpgt_epi8(hi, v));
+        unsigned stop = ~(unsigned)_mm256_movemask_epi8(ok);
+
+        if (stop)
+            return i + __builtin_ctz(stop);
+    }
+    return i;
+}
+
+__attribute__((target("sse2"))) static size_t asciirun_sse2(char const* c, size_t clen)
+{
+    __m128i lo = _mm_set1_epi8(0x1f), hi = _mm_set1_epi8(0x7f);
+    size_t  i;
+
+    for (i = 0; i + 16 <= clen; i += 16)
+    {
+        __m128i  v    = _mm_loadu_si128((__m128i const*)(c + i));
+        __m128i  ok   = _mm_and_si128(_mm_cmpgt_epi8(v, lo), _mm_cmpgt_epi8(hi, v));
+        unsigned stop = ~(unsigned)_mm_movemask_epi8(ok) & 0xffff;
+
+        if (stop)
+            return i + __builtin_ctz(stop);
+    }
+    return i;
+}
+#endif
+
+/* length of the run of printable ASCII at the start of c */
+size_t utf8asciirun(char const* c, size_t clen)
+{
+    size_t i = 0;
+
+#if defined(ASCIIRUN_X86)
+    static int const avx2 = __builtin_cpu_supports("avx2");
+    static int const sse2 = __builtin_cpu_supports("sse2");
+
+    if (avx2)
+        i = asciirun_avx2(c, clen);
+    else if (sse2)
+        i = asciirun_sse2(c, clen);
+#endif
+    while (i < clen && BETWEEN((uchar)c[i], 0x20, 0x7e))
+        i++;
+    return i;
+}
@@ -11,4 +11,5 @@ size_t utf8decode(char const* c, Rune& u, size_t clen);
 Rune   utf8decodebyte(char c, size_t* i);
 size_t utf8encode(Rune u, char* c);
 char   utf8encodebyte(Rune u, size_t i);
-size_t utf8validate(Rune& u, size_t i);
\ No newline at end of file
+size_t utf8validate(Rune& u, size_t i);
+size_t utf8asciirun(char const* c, size_t clen);
\ No newline at end of file
@@ -53,3 +53,5 @@ void xsetsel(char*);
 int  xstartdraw(void);
 void xximspot(int, int);
 void xdrawsixel(size_t, size_t);
+void xfreesixel(Image&);
+void xscroll(int, int, int);
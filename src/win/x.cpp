@@ -66,3 +66,9 @@ void xximspot(int, int)
 
 void xdrawsixel(size_t, size_t)
 {}
+
+void xfreesixel(Image&)
+{}
+
+void xscroll(int, int, int)
+{}
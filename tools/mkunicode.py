@@ -0,0 +1,121 @@
+#!/usr/bin/env python3
+# Generate src/unicode_data.hpp from the Unicode character database.
+#
+#     tools/mkunicode.py [ucd dir] > src/unicode_data.hpp
+#
+# The directory defaults to tools/ucd, which holds the files used:
+# DerivedGeneralCategory.txt, EastAsianWidth.txt, PropList.txt and
+# emoji-data.txt. The same files from https://www.unicode.org/Public/
+# <version>/ucd/ work as they are, the first one is under extracted/ there
+# and the last one under emoji/.
+
+import os
+import re
+import sys
+
+MAX = 0x110000
+
+# unassigned code points in these default to Wide, see EastAsianWidth.txt
+WIDE = [(0x3400, 0x4DBF), (0x4E00, 0x9FFF), (0xF900, 0xFAFF), (0x20000, 0x2FFFD), (0x30000, 0x3FFFD)]
+
+# Hangul Jungseong and Jongseong take no cell, they join the syllable before
+JAMO = [(0x1160, 0x11FF), (0xD7B0, 0xD7FF)]
+
+# not Wide by East_Asian_Width but drawn two cells wide, glibc agrees
+WIDE2 = [(0x3248, 0x324F), (0x4DC0, 0x4DFF)]
+
+
+def parse(path):
+    """The ranges and values of a "first..last ; value # comment" file."""
+    with open(path, encoding="utf-8") as f:
+        for line in f:
+            line = line.split("#", 1)[0].strip()
+            if not line:
+                continue
+            r, v = (s.strip() for s in line.split(";")[:2])
+            first, _, last = r.partition("..")
+            yield int(first, 16), int(last or first, 16), v
+
+
+def table(path, default, want=None):
+    t = [default] * MAX
+    for first, last, v in parse(path):
+        if want is None:
+            t[first : last + 1] = [v] * (last - first + 1)
+        elif v == want:
+            t[first : last + 1] = [True] * (last - first + 1)
+    return t
+
+
+def prop(u, gc, ea, emoji, pcm):
+    if gc == "Cc":
+        return "UNI_CONTROL"
+    if gc in ("Mn", "Me"):
+        return "UNI_COMBINING"
+    if (gc == "Cf" and u != 0x00AD and not pcm) or u == 0x200B or any(a <= u <= b for a, b in JAMO):
+        return "0"
+
+    p = "2" if ea in ("W", "F") or any(a <= u <= b for a, b in WIDE2) else "1"
+    if emoji:
+        p += " | UNI_EMOJI"
+    if 0x2500 <= u <= 0x259F:
+        p += " | UNI_BOXDRAW"
+    if 0x2800 <= u <= 0x28FF:
+        p += " | UNI_BRAILLE"
+    return p
+
+
+def main():
+    ucd = sys.argv[1] if len(sys.argv) > 1 else os.path.join(os.path.dirname(__file__), "ucd")
+
+    gc = table(os.path.join(ucd, "DerivedGeneralCategory.txt"), "Cn")
+    ea = ["N"] * MAX
+    for a, b in WIDE:
+        ea[a : b + 1] = ["W"] * (b - a + 1)
+    for first, last, v in parse(os.path.join(ucd, "EastAsianWidth.txt")):
+        ea[first : last + 1] = [v] * (last - first + 1)
+    emoji = table(os.path.join(ucd, "emoji-data.txt"), False, "Emoji_Presentation")
+    pcm = table(os.path.join(ucd, "PropList.txt"), False, "Prepended_Concatenation_Mark")
+
+    version = "?"
+    with open(os.path.join(ucd, "EastAsianWidth.txt"), encoding="utf-8") as f:
+        m = re.search(r"EastAsianWidth-(\d+\.\d+)|Unicode (\d+\.\d+)", f.read(4096))
+        if m:
+            version = m.group(1) or m.group(2)
+
+    ranges = []
+    for u in range(MAX):
+        p = prop(u, gc[u], ea[u], emoji[u], pcm[u])
+        if ranges and ranges[-1][1] == u - 1 and ranges[-1][2] == p:
+            ranges[-1][1] = u
+        else:
+            ranges.append([u, u, p])
+
+    out = sys.stdout
+    out.write(f"""#pragma once
+#include "unicode.hpp"
+
+// Code point properties, generated by tools/mkunicode.py from the Unicode
+// {version} character database in tools/ucd: General_Category,
+// East_Asian_Width, Prepended_Concatenation_Mark and Emoji_Presentation.
+// Ranges are sorted and only list code points that are not a plain one
+// cell character. Widths follow glibc's wcwidth: Mn, Me, Cf (but U+00AD
+// and the prepended concatenation marks), U+200B and Hangul medial vowels
+// and final consonants take no cell, East Asian Wide and Fullwidth take
+// two and so do U+3248 - U+324F and U+4DC0 - U+4DFF, everything else one.
+struct UniRange
+{{
+    uint32_t first;
+    uint32_t last;
+    uint8_t  prop;
+}};
+
+inline constexpr UniRange uniranges[] = {{
+""")
+    for first, last, p in ranges:
+        if p != "1":
+            out.write(f"    {{0x{first:05X}, 0x{last:05X}, {p}}},\n")
+    out.write("};\n")
+
+
+main()